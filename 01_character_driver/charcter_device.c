@@ -5,37 +5,244 @@
 #include <linux/uaccess.h>
 #include <linux/cdev.h>
 #include <linux/ioctl.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
+#include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+
+#include "vsensor.h"
+#include "vdrv_wake.h"
+
+#define VDRV_TRACE_SYSTEM vsensor
+#define CREATE_TRACE_POINTS
+#include "vdrv_trace.h"
 
 #define DEVICE_NAME "vsensor"
-#define MAJOR_NUM 240
-#define IOCTL_CALIBRATE _IO(MAJOR_NUM, 0)
+
+#define VSENSOR_MAX_RING (1U << 22)     // slots
+#define VSENSOR_MIN_TICK_NS 100000      // faster rates are produced in batches per tick
+#define VSENSOR_MAX_RATE 1000000        // Hz, at most 100 samples per tick
+#define VSENSOR_MAX_BATCH 256           // samples per tick, bounds the hard-IRQ work
+
+static unsigned int sample_rate_hz = 1000;
+module_param(sample_rate_hz, uint, 0444);
+MODULE_PARM_DESC(sample_rate_hz, "Sensor sampling rate in Hz, at most 1000000 (default: 1000)");
+
+static unsigned int ring_size = 4096;
+module_param(ring_size, uint, 0444);
+MODULE_PARM_DESC(ring_size, "Sample ring slots, rounded up to a power of two (default: 4096)");
+
+static unsigned int low_watermark = 1;
+module_param(low_watermark, uint, 0644);
+MODULE_PARM_DESC(low_watermark, "Samples pending before a reader is woken, per-file override via IOCTL_SET_LOWAT (default: 1)");
+
+/*
+ * One producer (the hrtimer) writes samples into the ring and publishes
+ * them by advancing hdr->head. Readers never write shared state: every
+ * open file keeps its own cursor, and mmap consumers keep theirs in user
+ * space, so any number of them drain in parallel. A reader that falls a
+ * ring behind skips to the oldest sample still held.
+ *
+ * The header page and the ring are one vmalloc_user() area, mapped
+ * read-only into consumers as-is. Blocked readers are woken through
+ * vdrv_wake.h, once per low-water mark rather than per sample.
+ */
+struct vsensor_dev {
+    struct vsensor_ring_hdr *hdr;
+    struct vsensor_sample *ring;
+    size_t area_size;
+    u64 mask;
+    struct vdrv_wake wake;
+    struct hrtimer timer;
+    ktime_t period;             // timer tick
+    u64 sample_ns;              // spacing of sample timestamps
+    u64 next_ns;                // timestamp of the next sample to produce
+    int value;
+};
+
+struct vsensor_reader {
+    struct mutex lock;          // only threads sharing this file contend here
+    u64 cursor;                 // index of the next sample this file returns
+    unsigned int lowat;         // samples pending before a blocked read or poll wakes
+};
+
+static struct vsensor_dev vsensor;
+
+static inline u64 vsensor_head(void)
+{
+    return smp_load_acquire(&vsensor.hdr->head);
+}
+
+static enum hrtimer_restart vsensor_sample_fn(struct hrtimer *timer)
+{
+    struct vsensor_dev *dev = container_of(timer, struct vsensor_dev, timer);
+    u64 head = dev->hdr->head;
+    u64 now = ktime_get_ns();
+    u64 n;
+    int value = READ_ONCE(dev->value);
+
+    // every sample due since the last tick, never more than a batch or a ring's worth
+    for (n = 0; dev->next_ns <= now && n <= dev->mask && n < VSENSOR_MAX_BATCH; n++, head++) {
+        struct vsensor_sample *s = &dev->ring[head & dev->mask];
+
+        smp_wmb(); // readers that see this slot change must also see the old head
+        s->timestamp_ns = dev->next_ns;
+        s->seq = head;
+        s->value = value;
+        smp_store_release(&dev->hdr->head, head + 1); // sample contents before the new head
+
+        dev->next_ns += dev->sample_ns;
+    }
+    if (dev->next_ns <= now) // fell a batch or a ring behind, don't try to catch up
+        dev->next_ns = now + dev->sample_ns;
+
+    if (n)
+        vdrv_wake_publish(&dev->wake, head);
+
+    hrtimer_forward_now(timer, dev->period);
+    return HRTIMER_RESTART;
+}
+
+// True once at least @need samples are pending for @rd; for wait_event and poll
+static bool vsensor_ready(struct vsensor_reader *rd, u64 need)
+{
+    return vdrv_wake_ready(&vsensor.wake, &vsensor.hdr->head, READ_ONCE(rd->cursor), need);
+}
 
 static int vsensor_open(struct inode *inode, struct file *file) {
-    printk(KERN_INFO "vsensor: device opened\n");
+    struct vsensor_reader *rd = kzalloc(sizeof(*rd), GFP_KERNEL);
+
+    if (!rd)
+        return -ENOMEM;
+
+    mutex_init(&rd->lock);
+    rd->cursor = vsensor_head(); // new readers start with new samples
+    rd->lowat = clamp_t(unsigned int, READ_ONCE(low_watermark), 1, vsensor.mask);
+    file->private_data = rd;
+
+    trace_vdrv_open(DEVICE_NAME, file);
     return 0;
 }
 
 static int vsensor_release(struct inode *inode, struct file *file) {
-    printk(KERN_INFO "vsensor: device closed\n");
+    trace_vdrv_release(DEVICE_NAME, file);
+    kfree(file->private_data);
     return 0;
 }
 
-static ssize_t vsensor_read(struct file *file, char __user *buf, size_t len, loff_t *offset) {
-    int sensor_value = 42; 
-    if (len < sizeof(int))
+static ssize_t __vsensor_read(struct file *file, char __user *buf, size_t len) {
+    struct vsensor_reader *rd = file->private_data;
+    size_t max = len / sizeof(struct vsensor_sample);
+    u64 head, start, n, first, chunk;
+    ssize_t ret;
+
+    if (!max)
         return -EINVAL;
 
-    if (copy_to_user(buf, &sensor_value, sizeof(int)))
-        return -EFAULT;
+    // block until the low-water mark, or a full buffer if that is smaller
+    if (!(file->f_flags & O_NONBLOCK)) {
+        size_t need = min_t(size_t, READ_ONCE(rd->lowat), max);
+
+        ret = wait_event_interruptible(vsensor.wake.wq, vsensor_ready(rd, need));
+        if (ret)
+            return ret;
+    }
+
+    mutex_lock(&rd->lock);
+retry:
+    head = vsensor_head();
+    start = rd->cursor;
+    if (head - start > vsensor.mask) // lapped: skip to the oldest stable sample
+        start = head - vsensor.mask;
+
+    n = min_t(u64, head - start, max);
+    if (!n) {
+        ret = -EAGAIN;
+        goto out;
+    }
+
+    // one copy_to_user, two if the range wraps around the end of the ring
+    first = start & vsensor.mask;
+    chunk = min(n, vsensor.mask + 1 - first);
+    if (copy_to_user(buf, &vsensor.ring[first], chunk * sizeof(struct vsensor_sample)) ||
+        (n > chunk && copy_to_user(buf + chunk * sizeof(struct vsensor_sample), vsensor.ring,
+                                   (n - chunk) * sizeof(struct vsensor_sample)))) {
+        ret = -EFAULT;
+        goto out;
+    }
+
+    // if the producer reached our oldest slot while copying, it may be torn
+    smp_rmb();
+    if (READ_ONCE(vsensor.hdr->head) - start > vsensor.mask)
+        goto retry;
 
-    printk(KERN_INFO "vsensor: sensor value read: %d\n", sensor_value);
-    return sizeof(int);
+    rd->cursor = start + n;
+    ret = n * sizeof(struct vsensor_sample);
+out:
+    mutex_unlock(&rd->lock);
+    return ret;
 }
 
-static long vsensor_ioctl(struct file *file, unsigned int cmd, unsigned long arg) {
+static ssize_t vsensor_read(struct file *file, char __user *buf, size_t len, loff_t *offset) {
+    ssize_t ret = __vsensor_read(file, buf, len);
+
+    trace_vdrv_read(DEVICE_NAME, len, ret);
+    return ret;
+}
+
+static __poll_t vsensor_poll(struct file *file, poll_table *wait)
+{
+    struct vsensor_reader *rd = file->private_data;
+
+    poll_wait(file, &vsensor.wake.wq, wait);
+    return vsensor_ready(rd, READ_ONCE(rd->lowat)) ? EPOLLIN | EPOLLRDNORM : 0;
+}
+
+// read-only view of the header page and ring; writers are refused
+static int vsensor_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    int ret = -EPERM;
+
+    if (!(vma->vm_flags & VM_WRITE)) {
+        vma->vm_flags &= ~VM_MAYWRITE;
+        ret = remap_vmalloc_range(vma, vsensor.hdr, vma->vm_pgoff);
+    }
+
+    trace_vdrv_mmap(DEVICE_NAME, vma->vm_pgoff, vma->vm_end - vma->vm_start, ret);
+    return ret;
+}
+
+static long __vsensor_ioctl(struct file *file, unsigned int cmd, unsigned long arg) {
+    struct vsensor_reader *rd = file->private_data;
+    int lowat;
+    u64 cursor;
+
     switch(cmd) {
         case IOCTL_CALIBRATE:
-            printk(KERN_INFO "vsensor: calibration performed\n");
+            WRITE_ONCE(vsensor.value, 42);
+            break;
+        case IOCTL_SET_LOWAT:
+            if (copy_from_user(&lowat, (int __user *)arg, sizeof(lowat)))
+                return -EFAULT;
+            if (lowat <= 0 || lowat > vsensor.mask)
+                return -EINVAL;
+            WRITE_ONCE(rd->lowat, lowat);
+            wake_up_interruptible_poll(&vsensor.wake.wq, EPOLLIN | EPOLLRDNORM); // let waiters re-check
+            break;
+        case IOCTL_SET_CURSOR:
+            // mmap consumers report their position before sleeping in poll()
+            if (copy_from_user(&cursor, (u64 __user *)arg, sizeof(cursor)))
+                return -EFAULT;
+            if ((s64)(cursor - vsensor_head()) > 0)
+                return -EINVAL;
+            mutex_lock(&rd->lock);
+            WRITE_ONCE(rd->cursor, cursor);
+            mutex_unlock(&rd->lock);
             break;
         default:
             return -EINVAL;
@@ -43,22 +250,71 @@ static long vsensor_ioctl(struct file *file, unsigned int cmd, unsigned long arg
     return 0;
 }
 
+static long vsensor_ioctl(struct file *file, unsigned int cmd, unsigned long arg) {
+    long ret = __vsensor_ioctl(file, cmd, arg);
+
+    trace_vdrv_ioctl(DEVICE_NAME, cmd, ret);
+    return ret;
+}
+
 static struct file_operations fops = {
     .owner = THIS_MODULE,
     .open = vsensor_open,
     .release = vsensor_release,
     .read = vsensor_read,
+    .poll = vsensor_poll,
+    .mmap = vsensor_mmap,
     .unlocked_ioctl = vsensor_ioctl,
 };
 
 static int __init vsensor_init(void) {
-    register_chrdev(MAJOR_NUM, DEVICE_NAME, &fops);
-    printk(KERN_INFO "vsensor: character device registered\n");
+    unsigned int slots;
+    int ret;
+
+    if (!sample_rate_hz || sample_rate_hz > VSENSOR_MAX_RATE)
+        return -EINVAL;
+    if (ring_size < 2 || ring_size > VSENSOR_MAX_RING)
+        return -EINVAL;
+    slots = roundup_pow_of_two(ring_size);
+
+    // header page first, so the ring starts page aligned in the mapping
+    vsensor.area_size = PAGE_SIZE + PAGE_ALIGN((size_t)slots * sizeof(struct vsensor_sample));
+    vsensor.hdr = vmalloc_user(vsensor.area_size);
+    if (!vsensor.hdr)
+        return -ENOMEM;
+    vsensor.ring = (void *)vsensor.hdr + PAGE_SIZE;
+    vsensor.mask = slots - 1;
+
+    vsensor.hdr->version = VSENSOR_RING_VERSION;
+    vsensor.hdr->sample_size = sizeof(struct vsensor_sample);
+    vsensor.hdr->ring_size = slots;
+    vsensor.hdr->data_offset = PAGE_SIZE;
+
+    vsensor.value = 42;
+    vdrv_wake_init(&vsensor.wake);
+
+    ret = register_chrdev(VSENSOR_MAJOR, DEVICE_NAME, &fops);
+    if (ret < 0) {
+        vfree(vsensor.hdr);
+        return ret;
+    }
+
+    vsensor.sample_ns = div_u64(NSEC_PER_SEC, sample_rate_hz);
+    vsensor.period = ns_to_ktime(max_t(u64, vsensor.sample_ns, VSENSOR_MIN_TICK_NS));
+    vsensor.next_ns = ktime_get_ns() + vsensor.sample_ns;
+    hrtimer_init(&vsensor.timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    vsensor.timer.function = vsensor_sample_fn;
+    hrtimer_start(&vsensor.timer, vsensor.period, HRTIMER_MODE_REL);
+
+    printk(KERN_INFO "vsensor: character device registered (%u Hz, %u slots)\n",
+           sample_rate_hz, slots);
     return 0;
 }
 
 static void __exit vsensor_exit(void) {
-    unregister_chrdev(MAJOR_NUM, DEVICE_NAME);
+    hrtimer_cancel(&vsensor.timer);
+    unregister_chrdev(VSENSOR_MAJOR, DEVICE_NAME);
+    vfree(vsensor.hdr);
     printk(KERN_INFO "vsensor: character device unregistered\n");
 }
 
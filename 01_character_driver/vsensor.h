@@ -0,0 +1,38 @@
+/* vsensor.h - vsensor interface shared by the driver and user space */
+#ifndef _VSENSOR_H
+#define _VSENSOR_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define VSENSOR_MAJOR 240
+
+#define IOCTL_CALIBRATE  _IO(VSENSOR_MAJOR, 0)
+#define IOCTL_SET_LOWAT  _IOW(VSENSOR_MAJOR, 1, int)
+#define IOCTL_SET_CURSOR _IOW(VSENSOR_MAJOR, 2, __u64)  // next sample index this file waits for
+
+#define VSENSOR_RING_VERSION 1
+
+// what read() hands out, packed back to back, and one ring slot
+struct vsensor_sample {
+    __u64 timestamp_ns;     // CLOCK_MONOTONIC
+    __u32 seq;              // low 32 bits of the sample's index
+    __s32 value;
+};
+
+/*
+ * First page of the read-only mapping of /dev/vsensor. Sample i lives in
+ * slot (i & (ring_size - 1)) starting data_offset bytes into the mapping,
+ * and is valid once head > i. The slot at head is rewritten before head
+ * moves on, so only the ring_size - 1 samples below head are stable.
+ * Consumers keep their own cursor; there is no shared consumer index.
+ */
+struct vsensor_ring_hdr {
+    __u32 version;          // VSENSOR_RING_VERSION
+    __u32 sample_size;      // sizeof(struct vsensor_sample)
+    __u32 ring_size;        // slots, a power of two
+    __u32 data_offset;      // bytes from the start of the mapping to slot 0
+    __u64 head;             // index of the next sample, written with release semantics
+};
+
+#endif /* _VSENSOR_H */
@@ -0,0 +1,188 @@
+/*
+ * vsensor_ring.h - header-only user-space consumer for the vsensor ring
+ *
+ * Maps /dev/vsensor read-only and drains samples straight out of the
+ * shared ring: no syscall and no copy while samples are pending, one
+ * ioctl() + poll() to sleep when the ring is empty.
+ *
+ *     struct vsensor_ring r;
+ *     const struct vsensor_sample *s;
+ *     size_t n;
+ *
+ *     vsensor_ring_open(&r, "/dev/vsensor");
+ *     for (;;) {
+ *         n = vsensor_ring_peek(&r, &s, 1024);
+ *         if (!n) {
+ *             vsensor_ring_wait(&r, -1);
+ *             continue;
+ *         }
+ *         consume(s, n);
+ *         if (vsensor_ring_release(&r, n))
+ *             ... producer overwrote part of s[] while we used it ...
+ *     }
+ */
+#ifndef _VSENSOR_RING_H
+#define _VSENSOR_RING_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "vsensor.h"
+
+struct vsensor_ring {
+    int fd;
+    void *map;
+    size_t map_len;
+    const struct vsensor_ring_hdr *hdr;
+    const struct vsensor_sample *slots;
+    __u64 mask;
+    __u64 cursor;   // index of the next sample to consume
+    __u64 lost;     // samples overwritten before they were consumed
+};
+
+static inline __u64 vsensor_ring_head(const struct vsensor_ring *r)
+{
+    return __atomic_load_n(&r->hdr->head, __ATOMIC_ACQUIRE);
+}
+
+static inline void vsensor_ring_close(struct vsensor_ring *r)
+{
+    if (r->map && r->map != MAP_FAILED)
+        munmap(r->map, r->map_len);
+    if (r->fd >= 0)
+        close(r->fd);
+    r->map = NULL;
+    r->fd = -1;
+}
+
+// Map @path and start at the current head. Returns 0 or a negative errno.
+static inline int vsensor_ring_open(struct vsensor_ring *r, const char *path)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    struct vsensor_ring_hdr hdr;
+    void *p;
+    int err;
+
+    memset(r, 0, sizeof(*r));
+    r->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (r->fd < 0)
+        return -errno;
+
+    // the header page alone tells us how much to map
+    p = mmap(NULL, page, PROT_READ, MAP_SHARED, r->fd, 0);
+    if (p == MAP_FAILED) {
+        err = -errno;
+        goto fail;
+    }
+    memcpy(&hdr, p, sizeof(hdr));
+    munmap(p, page);
+
+    if (hdr.version != VSENSOR_RING_VERSION ||
+        hdr.sample_size != sizeof(struct vsensor_sample)) {
+        err = -EPROTO;
+        goto fail;
+    }
+
+    r->map_len = hdr.data_offset + (size_t)hdr.ring_size * hdr.sample_size;
+    r->map = mmap(NULL, r->map_len, PROT_READ, MAP_SHARED, r->fd, 0);
+    if (r->map == MAP_FAILED) {
+        err = -errno;
+        goto fail;
+    }
+    r->hdr = r->map;
+    r->slots = (const void *)((const char *)r->map + hdr.data_offset);
+    r->mask = hdr.ring_size - 1;
+    r->cursor = vsensor_ring_head(r);
+    return 0;
+
+fail:
+    vsensor_ring_close(r);
+    return err;
+}
+
+/*
+ * Point *@out at up to @max unread samples, contiguous in the ring, and
+ * return how many. Nothing is copied; the samples stay valid until the
+ * producer laps them, which vsensor_ring_release() reports.
+ */
+static inline size_t vsensor_ring_peek(struct vsensor_ring *r,
+                                       const struct vsensor_sample **out, size_t max)
+{
+    __u64 head = vsensor_ring_head(r);
+    __u64 slot, avail;
+
+    if (head - r->cursor > r->mask) { // lapped: skip to the oldest stable sample
+        r->lost += head - r->mask - r->cursor;
+        r->cursor = head - r->mask;
+    }
+
+    slot = r->cursor & r->mask;
+    avail = head - r->cursor;
+    if (avail > r->mask + 1 - slot)
+        avail = r->mask + 1 - slot;
+    if (avail > max)
+        avail = max;
+
+    *out = &r->slots[slot];
+    return avail;
+}
+
+/*
+ * Done with the first @n samples of the last peek. Returns 0, or -ESTALE
+ * if the producer overwrote some of them while they were in use.
+ */
+static inline int vsensor_ring_release(struct vsensor_ring *r, size_t n)
+{
+    __u64 start = r->cursor;
+    __u64 head;
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE); // sample loads before the head check
+    head = __atomic_load_n(&r->hdr->head, __ATOMIC_RELAXED);
+
+    r->cursor += n;
+    return head - start > r->mask ? -ESTALE : 0;
+}
+
+// Copy up to @max samples into @buf, retrying if they were overwritten meanwhile.
+static inline size_t vsensor_ring_read(struct vsensor_ring *r,
+                                       struct vsensor_sample *buf, size_t max)
+{
+    const struct vsensor_sample *s;
+    size_t done = 0, n;
+
+    while (done < max) {
+        __u64 start = r->cursor;
+
+        n = vsensor_ring_peek(r, &s, max - done);
+        if (!n)
+            break;
+        memcpy(buf + done, s, n * sizeof(*s));
+        if (vsensor_ring_release(r, n)) {
+            r->cursor = start; // peek will skip past what was overwritten
+            continue;
+        }
+        done += n;
+    }
+    return done;
+}
+
+/*
+ * Sleep until the driver's low-water mark is met past our cursor, or
+ * @timeout_ms passes (-1 waits forever). Returns poll()'s result.
+ */
+static inline int vsensor_ring_wait(struct vsensor_ring *r, int timeout_ms)
+{
+    struct pollfd pfd = { .fd = r->fd, .events = POLLIN };
+
+    if (ioctl(r->fd, IOCTL_SET_CURSOR, &r->cursor) < 0)
+        return -errno;
+    return poll(&pfd, 1, timeout_ms);
+}
+
+#endif /* _VSENSOR_RING_H */
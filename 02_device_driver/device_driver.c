@@ -1,131 +1,890 @@
 #include <linux/module.h>
 #include <linux/init.h>
 #include <linux/blkdev.h>
-#include <linux/genhd.h>
+#include <linux/blk-mq.h>
 #include <linux/hdreg.h>
-#include <linux/vmalloc.h>
+#include <linux/xarray.h>
+#include <linux/highmem.h>
+#include <linux/slab.h>
+#include <linux/log2.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 #include <linux/errno.h>
 
+#include "vdrv_lathist.h"
+
 #define DEVICE_NAME "vblock"
 #define VBLK_MAJOR 240
-#define NSECTORS 1024
-#define SECTOR_SIZE 512
+#define VBLK_MAX_DEVICES 64
+
+// snapshot ioctls, issued on the vblock<N> block device
+#define IOCTL_SNAP_CREATE   _IO(VBLK_MAJOR, 0)
+#define IOCTL_SNAP_ROLLBACK _IO(VBLK_MAJOR, 1)
+#define IOCTL_SNAP_DELETE   _IO(VBLK_MAJOR, 2)
+
+static unsigned int nr_devices = 1;
+module_param(nr_devices, uint, 0444);
+MODULE_PARM_DESC(nr_devices, "Number of vblock devices (default: 1)");
+
+static unsigned long long capacity = 512 * 1024;
+module_param(capacity, ullong, 0444);
+MODULE_PARM_DESC(capacity, "Size of each device in bytes (default: 512 KiB)");
+
+static unsigned int logical_block_size = SECTOR_SIZE;
+module_param(logical_block_size, uint, 0444);
+MODULE_PARM_DESC(logical_block_size, "Logical block size: 512 or 4096 (default: 512)");
+
+static unsigned int physical_block_size; // 0 = same as logical_block_size
+module_param(physical_block_size, uint, 0444);
+MODULE_PARM_DESC(physical_block_size, "Physical block size (default: logical_block_size)");
+
+static int numa_node[VBLK_MAX_DEVICES] = { [0 ... VBLK_MAX_DEVICES - 1] = NUMA_NO_NODE };
+module_param_array(numa_node, int, NULL, 0444);
+MODULE_PARM_DESC(numa_node, "Home NUMA node of each device, comma separated (default: -1, any node)");
+
+static unsigned int nr_hw_queues; // 0 = one hardware context per CPU
+module_param(nr_hw_queues, uint, 0444);
+MODULE_PARM_DESC(nr_hw_queues, "Number of hardware queues (default: one per CPU)");
+
+static unsigned int hw_queue_depth = 128;
+module_param(hw_queue_depth, uint, 0444);
+MODULE_PARM_DESC(hw_queue_depth, "Tag set depth per hardware queue (default: 128)");
+
+static unsigned int poll_queues;
+module_param(poll_queues, uint, 0444);
+MODULE_PARM_DESC(poll_queues, "Extra hardware queues for polled I/O (IORING_SETUP_IOPOLL, RWF_HIPRI), blk-mq mode only (default: 0)");
+
+enum {
+    VBLK_Q_BIO = 0, // submit_bio straight into the backing store
+    VBLK_Q_MQ  = 1, // blk-mq request queue
+};
+
+static int queue_mode = VBLK_Q_MQ;
+module_param(queue_mode, int, 0444);
+MODULE_PARM_DESC(queue_mode, "I/O submission mode: 0=bio, 1=blk-mq (default: 1)");
+
+static unsigned int max_discard_sectors = UINT_MAX >> SECTOR_SHIFT;
+module_param(max_discard_sectors, uint, 0444);
+MODULE_PARM_DESC(max_discard_sectors, "Largest DISCARD/WRITE_ZEROES request in sectors (0 disables)");
+
+// per hardware queue state; poll queues park requests here until ->poll runs
+struct vblock_queue {
+    spinlock_t poll_lock;
+    struct list_head poll_list;
+};
+
+// per request driver data
+struct vblock_cmd {
+    u64 start_ns;
+};
 
 struct vblock_dev {
-    int size;
-    u8 *data;
-    struct request_queue *queue;
+    int index;                      // minor number, vblock<index>
+    int node;                       // home NUMA node for pages and queues
+    u64 size;                       // device size in bytes
+    struct xarray pages;            // backing pages, allocated on first write
+    struct xarray snap;             // snapshot: pre-images of pages changed since it was taken
+    bool snap_active;
+    spinlock_t snap_lock;           // serializes copy-on-write of a page
+    struct mutex snap_mutex;        // serializes the snapshot ioctls
+    struct blk_mq_tag_set tag_set;  // per-CPU hardware contexts
+    struct vblock_queue *queues;    // one per hardware context
     struct gendisk *gd;
+    struct vdrv_lathist lat;        // per-CPU, see vdrv_lathist.h
+    struct dentry *dbg_dir;
 };
 
-static struct vblock_dev vblock;
+static struct vblock_dev *vblock_devs;
+static struct dentry *vblock_dbg_root;
+
+// queue_rq must not sleep, the bio path may
+static inline gfp_t vblock_gfp(void)
+{
+    return queue_mode == VBLK_Q_BIO ? GFP_NOIO : GFP_NOWAIT;
+}
 
-static void vblock_request(struct request_queue *q)
+// allocate the backing page for idx; if another writer raced us, use theirs
+static struct page *vblock_insert_page(struct vblock_dev *dev, pgoff_t idx)
 {
-    struct request *req; // request block
+    gfp_t gfp = vblock_gfp();
+    struct page *page, *cur;
 
-    while ((req = blk_fetch_request(q)) != NULL) {
-        struct bio_vec bv; //memory segment 
-        struct req_iterator iter; // iteration
-        sector_t sector = blk_rq_pos(req); // sector number 
+    page = alloc_pages_node(dev->node, gfp | __GFP_ZERO | __GFP_HIGHMEM | __GFP_NOWARN, 0);
+    if (!page)
+        return NULL;
 
-        rq_for_each_segment(bv, req, iter) { // for each sector
-            unsigned long offset = sector * SECTOR_SIZE; // the sector is conveted into byte index
-            char *buffer = kmap(bv.bv_page) + bv.bv_offset; // buffer is the place where the kernel buffer is converted into virtual memory and buffer is the pointer
+    cur = xa_cmpxchg(&dev->pages, idx, NULL, page, gfp);
+    if (unlikely(cur)) {
+        __free_page(page);
+        return xa_is_err(cur) ? NULL : cur;
+    }
+    return page;
+}
 
-            if (offset + bv.bv_len > vblock.size) { 
-                kunmap(bv.bv_page);
-                __blk_end_request_all(req, -EIO);
+/*
+ * Copy-on-write. While a snapshot exists, the first change to a page
+ * moves the current page into dev->snap and gives the live device a
+ * private copy (or, for discard, nothing). Pages that were holes when
+ * the snapshot was taken are recorded as a value entry so rollback can
+ * punch them out again. Pages that never change stay shared, so taking
+ * a snapshot costs nothing up front.
+ *
+ * The snapshot slot is reserved before the live entry is replaced and
+ * only filled afterwards, so a writer that finds the slot filled is
+ * guaranteed to see the private copy.
+ */
+static int vblock_cow(struct vblock_dev *dev, pgoff_t idx, bool drop)
+{
+    struct page *old, *copy = NULL;
+    int ret;
+
+    if (!READ_ONCE(dev->snap_active))
+        return 0;
+    if (xa_load(&dev->snap, idx)) {
+        smp_rmb(); // pairs with the store ordering below
+        return 0;
+    }
+
+    if (!drop) {
+        copy = alloc_pages_node(dev->node, vblock_gfp() | __GFP_HIGHMEM | __GFP_NOWARN, 0);
+        if (!copy)
+            return -ENOMEM;
+    }
+
+    ret = xa_reserve(&dev->snap, idx, vblock_gfp());
+    if (ret)
+        goto out;
+
+    spin_lock(&dev->snap_lock);
+    if (!xa_load(&dev->snap, idx)) {
+        old = xa_load(&dev->pages, idx);
+        if (old && drop) {
+            xa_erase(&dev->pages, idx);
+        } else if (old) {
+            copy_highpage(copy, old);
+            xa_store(&dev->pages, idx, copy, GFP_ATOMIC); // replaces, never allocates
+            copy = NULL;
+        }
+        // slot was reserved above, so this cannot fail
+        xa_store(&dev->snap, idx, old ? (void *)old : xa_mk_value(0), GFP_ATOMIC);
+    }
+    spin_unlock(&dev->snap_lock);
+
+out:
+    if (copy)
+        __free_page(copy);
+    return ret;
+}
+
+// pages are looked up and copied under RCU; discard frees them after a grace period
+static int vblock_copy_to_dev(struct vblock_dev *dev, const void *src,
+                              loff_t pos, unsigned int len)
+{
+    while (len) {
+        pgoff_t idx = pos >> PAGE_SHIFT;
+        unsigned int off = offset_in_page(pos);
+        unsigned int chunk = min_t(unsigned int, len, PAGE_SIZE - off);
+        struct page *page;
+        void *dst;
+
+        if (vblock_cow(dev, idx, false))
+            return -ENOMEM;
+
+        for (;;) {
+            rcu_read_lock();
+            page = xa_load(&dev->pages, idx);
+            if (page)
                 break;
-            }
+            rcu_read_unlock();
+
+            // allocation may sleep in bio mode, so it happens outside RCU
+            if (!vblock_insert_page(dev, idx))
+                return -ENOMEM;
+        }
+
+        dst = kmap_local_page(page);
+        memcpy(dst + off, src, chunk);
+        kunmap_local(dst);
+        rcu_read_unlock();
 
-            if (rq_data_dir(req) == WRITE) // checks if it is read /write
-                memcpy(vblock.data + offset, buffer, bv.bv_len);
-            else
-                memcpy(buffer, vblock.data + offset, bv.bv_len);
+        src += chunk;
+        pos += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
 
-            kunmap(bv.bv_page);
-            sector += bv.bv_len / SECTOR_SIZE;
+// sectors that were never written read back as zeroes without allocating
+static void vblock_copy_from_dev(struct vblock_dev *dev, void *dst,
+                                 loff_t pos, unsigned int len)
+{
+    while (len) {
+        unsigned int off = offset_in_page(pos);
+        unsigned int chunk = min_t(unsigned int, len, PAGE_SIZE - off);
+        struct page *page;
+
+        rcu_read_lock();
+        page = xa_load(&dev->pages, pos >> PAGE_SHIFT);
+        if (page) {
+            void *src = kmap_local_page(page);
+
+            memcpy(dst, src + off, chunk);
+            kunmap_local(src);
+        } else {
+            memset(dst, 0, chunk);
         }
+        rcu_read_unlock();
 
-        __blk_end_request_all(req, 0);
+        dst += chunk;
+        pos += chunk;
+        len -= chunk;
     }
 }
 
-static int vblock_create(struct vblock_dev *dev)
+static void vblock_free_page_rcu(struct rcu_head *head)
 {
-    dev->size = NSECTORS * SECTOR_SIZE; // the size
+    __free_page(container_of(head, struct page, rcu_head));
+}
 
-    dev->data = vmalloc(dev->size); // the data space
-    if (!dev->data)
-        return -ENOMEM;
+// zero bytes in pages that are already allocated; holes already read as zero
+static int vblock_zero_partial(struct vblock_dev *dev, loff_t pos, u64 len)
+{
+    while (len) {
+        unsigned int off = offset_in_page(pos);
+        unsigned int chunk = min_t(u64, len, PAGE_SIZE - off);
+        struct page *page;
 
-    memset(dev->data, 0, dev->size); // both place are conveted to 0 byte area or cleaned
+        if (xa_load(&dev->pages, pos >> PAGE_SHIFT) &&
+            vblock_cow(dev, pos >> PAGE_SHIFT, false))
+            return -ENOMEM;
 
-    if (register_blkdev(VBLK_MAJOR, DEVICE_NAME)) { // check if already registered
-        vfree(dev->data);
-        return -EBUSY;
+        rcu_read_lock();
+        page = xa_load(&dev->pages, pos >> PAGE_SHIFT);
+        if (page)
+            memzero_page(page, off, chunk);
+        rcu_read_unlock();
+
+        pos += chunk;
+        len -= chunk;
     }
+    return 0;
+}
 
-    dev->queue = blk_init_queue(vblock_request, NULL); // allocate queue
-    if (!dev->queue) {
-        unregister_blkdev(VBLK_MAJOR, DEVICE_NAME);
-        vfree(dev->data);
+/*
+ * DISCARD and WRITE_ZEROES: whole pages are dropped from the xarray and
+ * handed back to the page allocator, partial pages at either end are
+ * zeroed in place. Either way the range reads back as zeroes.
+ */
+static int vblock_zero_range(struct vblock_dev *dev, loff_t pos, u64 len)
+{
+    loff_t end = pos + len;
+    pgoff_t first = DIV_ROUND_UP_ULL(pos, PAGE_SIZE); // first whole page
+    pgoff_t last = end >> PAGE_SHIFT;                 // one past the last whole page
+    struct page *page;
+    unsigned long idx;
+
+    if (first >= last)
+        return vblock_zero_partial(dev, pos, len);
+
+    if (vblock_zero_partial(dev, pos, ((loff_t)first << PAGE_SHIFT) - pos))
         return -ENOMEM;
+
+    xa_for_each_range(&dev->pages, idx, page, first, last - 1) {
+        if (vblock_cow(dev, idx, true)) // moves the page into the snapshot, if any
+            return -ENOMEM;
+        page = xa_erase(&dev->pages, idx);
+        if (page)
+            call_rcu(&page->rcu_head, vblock_free_page_rcu);
     }
 
-    dev->gd = alloc_disk(1);
-    if (!dev->gd) {
-        blk_cleanup_queue(dev->queue);
-        unregister_blkdev(VBLK_MAJOR, DEVICE_NAME);
-        vfree(dev->data);
+    return vblock_zero_partial(dev, (loff_t)last << PAGE_SHIFT,
+                               end - ((loff_t)last << PAGE_SHIFT));
+}
+
+static blk_status_t vblock_do_discard(struct vblock_dev *dev, loff_t pos, u64 len)
+{
+    if (pos + len > dev->size)
+        return BLK_STS_IOERR;
+
+    return vblock_zero_range(dev, pos, len) ? BLK_STS_RESOURCE : BLK_STS_OK;
+}
+
+static void vblock_free_pages(struct vblock_dev *dev)
+{
+    struct page *page;
+    unsigned long idx;
+
+    xa_for_each(&dev->pages, idx, page)
+        __free_page(page);
+    xa_destroy(&dev->pages);
+}
+
+static void vblock_snap_free(struct vblock_dev *dev)
+{
+    unsigned long idx;
+    void *entry;
+
+    xa_for_each(&dev->snap, idx, entry)
+        if (!xa_is_value(entry))
+            __free_page(entry);
+    xa_destroy(&dev->snap);
+}
+
+// put every page changed since the snapshot back; the queue is frozen
+static int vblock_snap_rollback(struct vblock_dev *dev)
+{
+    unsigned long idx;
+    void *entry;
+
+    xa_for_each(&dev->snap, idx, entry) {
+        struct page *cur;
+
+        if (xa_is_value(entry))
+            cur = xa_erase(&dev->pages, idx); // was a hole
+        else
+            cur = xa_store(&dev->pages, idx, entry, GFP_NOIO);
+        if (xa_is_err(cur))
+            return xa_err(cur); // what is left stays in the snapshot, retry later
+
+        xa_erase(&dev->snap, idx);
+        if (cur)
+            __free_page(cur);
+    }
+    return 0;
+}
+
+static int vblock_ioctl(struct block_device *bdev, fmode_t mode,
+                        unsigned int cmd, unsigned long arg)
+{
+    struct vblock_dev *dev = bdev->bd_disk->private_data;
+    struct request_queue *q = bdev->bd_disk->queue;
+    int ret = 0;
+
+    switch (cmd) {
+    case IOCTL_SNAP_CREATE:
+    case IOCTL_SNAP_ROLLBACK:
+    case IOCTL_SNAP_DELETE:
+        break;
+    default:
+        return -ENOTTY;
+    }
+
+    if (!capable(CAP_SYS_ADMIN))
+        return -EPERM;
+
+    mutex_lock(&dev->snap_mutex);
+    switch (cmd) {
+    case IOCTL_SNAP_CREATE: // O(1): nothing is copied until a page changes
+        if (dev->snap_active) {
+            ret = -EBUSY;
+            break;
+        }
+        sync_blockdev(bdev);
+        blk_mq_freeze_queue(q);
+        WRITE_ONCE(dev->snap_active, true);
+        blk_mq_unfreeze_queue(q);
+        break;
+
+    case IOCTL_SNAP_ROLLBACK: // O(pages changed); the snapshot stays for the next reset
+        if (!dev->snap_active) {
+            ret = -ENOENT;
+            break;
+        }
+        sync_blockdev(bdev); // cached writes would land on top of the restored image
+        blk_mq_freeze_queue(q);
+        ret = vblock_snap_rollback(dev);
+        blk_mq_unfreeze_queue(q);
+        invalidate_bdev(bdev);
+        break;
+
+    case IOCTL_SNAP_DELETE:
+        if (!dev->snap_active) {
+            ret = -ENOENT;
+            break;
+        }
+        blk_mq_freeze_queue(q);
+        WRITE_ONCE(dev->snap_active, false);
+        blk_mq_unfreeze_queue(q);
+        vblock_snap_free(dev);
+        break;
+    }
+    mutex_unlock(&dev->snap_mutex);
+
+    return ret;
+}
+
+// copy one memory segment between the bio page and the backing store
+static blk_status_t vblock_do_bvec(struct vblock_dev *dev, struct bio_vec *bv,
+                                   loff_t pos, enum req_op op)
+{
+    char *buffer;
+    int ret = 0;
+
+    if (pos + bv->bv_len > dev->size)
+        return BLK_STS_IOERR;
+
+    buffer = kmap_local_page(bv->bv_page) + bv->bv_offset;
+    if (op == REQ_OP_WRITE) // checks if it is read /write
+        ret = vblock_copy_to_dev(dev, buffer, pos, bv->bv_len);
+    else
+        vblock_copy_from_dev(dev, buffer, pos, bv->bv_len);
+    kunmap_local(buffer);
+
+    return ret ? BLK_STS_RESOURCE : BLK_STS_OK;
+}
+
+// bio mode: no request layer, no tags, no merging - complete synchronously
+static void vblock_submit_bio(struct bio *bio)
+{
+    struct vblock_dev *dev = bio->bi_bdev->bd_disk->private_data;
+    loff_t pos = (loff_t)bio->bi_iter.bi_sector << SECTOR_SHIFT;
+    unsigned int bytes = bio->bi_iter.bi_size;
+    enum req_op op = bio_op(bio);
+    u64 start = ktime_get_ns();
+    struct bio_vec bv;
+    struct bvec_iter iter;
+
+    switch (op) {
+    case REQ_OP_READ:
+    case REQ_OP_WRITE:
+        break;
+    case REQ_OP_DISCARD:
+    case REQ_OP_WRITE_ZEROES:
+        bio->bi_status = vblock_do_discard(dev, pos, bytes);
+        vdrv_lathist_account(&dev->lat, op, bytes, start);
+        bio_endio(bio);
+        return;
+    default:
+        bio_io_error(bio);
+        return;
+    }
+
+    bio_for_each_segment(bv, bio, iter) {
+        blk_status_t status = vblock_do_bvec(dev, &bv, pos, op);
+
+        if (status) {
+            bio->bi_status = status;
+            break;
+        }
+        pos += bv.bv_len;
+    }
+
+    vdrv_lathist_account(&dev->lat, op, bytes, start);
+    bio_endio(bio);
+}
+
+static const struct block_device_operations vblock_fops = {
+    .owner = THIS_MODULE,
+    .ioctl = vblock_ioctl,
+};
+
+static const struct block_device_operations vblock_bio_fops = {
+    .owner = THIS_MODULE,
+    .submit_bio = vblock_submit_bio,
+    .ioctl = vblock_ioctl,
+};
+
+static blk_status_t vblock_handle_rq(struct vblock_dev *dev, struct request *req)
+{
+    struct bio_vec bv; //memory segment
+    struct req_iterator iter; // iteration
+    loff_t pos = (loff_t)blk_rq_pos(req) << SECTOR_SHIFT; // the sector is conveted into byte index
+    blk_status_t status = BLK_STS_OK;
+
+    switch (req_op(req)) {
+    case REQ_OP_READ:
+    case REQ_OP_WRITE:
+        break;
+    case REQ_OP_DISCARD:
+    case REQ_OP_WRITE_ZEROES:
+        return vblock_do_discard(dev, pos, blk_rq_bytes(req));
+    default:
+        return BLK_STS_IOERR;
+    }
+
+    // serviced inline: the backing store is RAM, so there is nothing to wait for
+    rq_for_each_segment(bv, req, iter) {
+        status = vblock_do_bvec(dev, &bv, pos, req_op(req));
+        if (status)
+            break;
+        pos += bv.bv_len;
+    }
+    return status;
+}
+
+static blk_status_t vblock_queue_rq(struct blk_mq_hw_ctx *hctx,
+                                    const struct blk_mq_queue_data *bd)
+{
+    struct request *req = bd->rq; // request block
+    struct vblock_dev *dev = hctx->queue->queuedata;
+    struct vblock_cmd *cmd = blk_mq_rq_to_pdu(req);
+    blk_status_t status;
+
+    cmd->start_ns = ktime_get_ns();
+    blk_mq_start_request(req);
+
+    if (hctx->type == HCTX_TYPE_POLL) { // completed from vblock_poll()
+        struct vblock_queue *vq = hctx->driver_data;
+
+        spin_lock(&vq->poll_lock);
+        list_add_tail(&req->queuelist, &vq->poll_list);
+        spin_unlock(&vq->poll_lock);
+        return BLK_STS_OK;
+    }
+
+    status = vblock_handle_rq(dev, req);
+    if (status == BLK_STS_RESOURCE)
+        return status; // out of pages, let blk-mq requeue and retry
+
+    vdrv_lathist_account(&dev->lat, req_op(req), blk_rq_bytes(req), cmd->start_ns);
+    blk_mq_end_request(req, status);
+    return BLK_STS_OK;
+}
+
+// service everything parked on a poll queue, completing in one batch
+static int vblock_poll(struct blk_mq_hw_ctx *hctx, struct io_comp_batch *iob)
+{
+    struct vblock_queue *vq = hctx->driver_data;
+    struct vblock_dev *dev = hctx->queue->queuedata;
+    LIST_HEAD(list);
+    int nr = 0;
+
+    spin_lock(&vq->poll_lock);
+    list_splice_init(&vq->poll_list, &list);
+    spin_unlock(&vq->poll_lock);
+
+    while (!list_empty(&list)) {
+        struct request *req = list_first_entry(&list, struct request, queuelist);
+        struct vblock_cmd *cmd = blk_mq_rq_to_pdu(req);
+        blk_status_t status;
+
+        list_del_init(&req->queuelist);
+        status = vblock_handle_rq(dev, req);
+        if (status == BLK_STS_RESOURCE) {
+            // out of pages: park the rest again and retry on the next poll
+            list_add(&req->queuelist, &list);
+            spin_lock(&vq->poll_lock);
+            list_splice(&list, &vq->poll_list);
+            spin_unlock(&vq->poll_lock);
+            break;
+        }
+
+        vdrv_lathist_account(&dev->lat, req_op(req), blk_rq_bytes(req), cmd->start_ns);
+        if (!blk_mq_add_to_batch(req, iob, status != BLK_STS_OK, blk_mq_end_request_batch))
+            blk_mq_end_request(req, status);
+        nr++;
+    }
+
+    return nr;
+}
+
+static int vblock_init_hctx(struct blk_mq_hw_ctx *hctx, void *data, unsigned int hctx_idx)
+{
+    struct vblock_dev *dev = data;
+
+    hctx->driver_data = &dev->queues[hctx_idx];
+    return 0;
+}
+
+/*
+ * Spread CPUs over the hardware queues starting with the device's home
+ * node, so local CPUs get queues (and request memory) of their own and
+ * remote CPUs share whatever is left over.
+ */
+static void vblock_map_cpus(struct blk_mq_queue_map *qmap, int node)
+{
+    unsigned int cpu, q = 0;
+
+    if (node == NUMA_NO_NODE) {
+        blk_mq_map_queues(qmap);
+        return;
+    }
+
+    for_each_possible_cpu(cpu)
+        if (cpu_to_node(cpu) == node)
+            qmap->mq_map[cpu] = qmap->queue_offset + q++ % qmap->nr_queues;
+
+    for_each_possible_cpu(cpu)
+        if (cpu_to_node(cpu) != node)
+            qmap->mq_map[cpu] = qmap->queue_offset + q++ % qmap->nr_queues;
+}
+
+// default queues first, then the poll queues; no separate read queues
+static void vblock_map_queues(struct blk_mq_tag_set *set)
+{
+    struct vblock_dev *dev = set->driver_data;
+    unsigned int i, offset = 0;
+
+    for (i = 0; i < set->nr_maps; i++) {
+        struct blk_mq_queue_map *map = &set->map[i];
+
+        switch (i) {
+        case HCTX_TYPE_DEFAULT:
+            map->nr_queues = set->nr_hw_queues - poll_queues;
+            break;
+        case HCTX_TYPE_POLL:
+            map->nr_queues = poll_queues;
+            break;
+        default:
+            map->nr_queues = 0;
+            continue;
+        }
+
+        map->queue_offset = offset;
+        offset += map->nr_queues;
+        vblock_map_cpus(map, dev->node);
+    }
+}
+
+static const struct blk_mq_ops vblock_mq_ops = {
+    .queue_rq = vblock_queue_rq,
+    .poll = vblock_poll,
+    .init_hctx = vblock_init_hctx,
+    .map_queues = vblock_map_queues,
+};
+
+// one row per operation, summed over size classes and CPUs
+static ssize_t latency_hist_show(struct device *d, struct device_attribute *attr,
+                                 char *buf)
+{
+    struct vblock_dev *dev = dev_to_disk(d)->private_data;
+
+    return vdrv_lathist_format(&dev->lat, buf);
+}
+static DEVICE_ATTR_RO(latency_hist);
+
+static struct attribute *vblock_attrs[] = {
+    &dev_attr_latency_hist.attr,
+    NULL,
+};
+
+static const struct attribute_group vblock_attr_group = {
+    .attrs = vblock_attrs,
+};
+
+static const struct attribute_group *vblock_attr_groups[] = {
+    &vblock_attr_group,
+    NULL,
+};
+
+static void vblock_free_mq(struct vblock_dev *dev)
+{
+    blk_mq_free_tag_set(&dev->tag_set);
+    kfree(dev->queues);
+    dev->queues = NULL;
+}
+
+static int vblock_alloc_mq_disk(struct vblock_dev *dev)
+{
+    unsigned int nr_queues = (nr_hw_queues ? nr_hw_queues : nr_cpu_ids) + poll_queues;
+    unsigned int i;
+    int ret;
+
+    dev->queues = kcalloc_node(nr_queues, sizeof(*dev->queues), GFP_KERNEL, dev->node);
+    if (!dev->queues)
         return -ENOMEM;
+
+    for (i = 0; i < nr_queues; i++) {
+        spin_lock_init(&dev->queues[i].poll_lock);
+        INIT_LIST_HEAD(&dev->queues[i].poll_list);
+    }
+
+    dev->tag_set.ops = &vblock_mq_ops;
+    dev->tag_set.nr_hw_queues = nr_queues;
+    dev->tag_set.nr_maps = poll_queues ? HCTX_MAX_TYPES : 1;
+    dev->tag_set.queue_depth = hw_queue_depth;
+    dev->tag_set.numa_node = dev->node;
+    dev->tag_set.cmd_size = sizeof(struct vblock_cmd);
+    dev->tag_set.flags = BLK_MQ_F_SHOULD_MERGE;
+    dev->tag_set.driver_data = dev;
+
+    ret = blk_mq_alloc_tag_set(&dev->tag_set); // allocate tags for every hardware queue
+    if (ret) {
+        kfree(dev->queues);
+        dev->queues = NULL;
+        return ret;
     }
 
+    dev->gd = blk_mq_alloc_disk(&dev->tag_set, dev);
+    if (IS_ERR(dev->gd)) {
+        ret = PTR_ERR(dev->gd);
+        dev->gd = NULL;
+        vblock_free_mq(dev);
+        return ret;
+    }
+
+    dev->gd->fops = &vblock_fops;
+    return 0;
+}
+
+static int vblock_alloc_bio_disk(struct vblock_dev *dev)
+{
+    dev->gd = blk_alloc_disk(dev->node);
+    if (!dev->gd)
+        return -ENOMEM;
+
+    dev->gd->fops = &vblock_bio_fops;
+    return 0;
+}
+
+static int vblock_create(struct vblock_dev *dev, int index)
+{
+    struct request_queue *q;
+    int ret;
+
+    dev->index = index;
+    dev->node = numa_node[index];
+    dev->size = capacity; // the size, already rounded to logical_block_size
+
+    xa_init(&dev->pages); // nothing is allocated until the first write
+    xa_init(&dev->snap);
+    spin_lock_init(&dev->snap_lock);
+    mutex_init(&dev->snap_mutex);
+
+    ret = vdrv_lathist_init(&dev->lat);
+    if (ret)
+        return ret;
+
+    if (queue_mode == VBLK_Q_BIO)
+        ret = vblock_alloc_bio_disk(dev);
+    else
+        ret = vblock_alloc_mq_disk(dev);
+    if (ret)
+        goto err_free_lat;
+
     dev->gd->major = VBLK_MAJOR;
-    dev->gd->first_minor = 0;
-    dev->gd->fops = &(struct block_device_operations){
-        .owner = THIS_MODULE,
-    };
-    dev->gd->queue = dev->queue;
+    dev->gd->first_minor = index;
+    dev->gd->minors = 1;
     dev->gd->private_data = dev;
 
-    snprintf(dev->gd->disk_name, 32, DEVICE_NAME);
-    set_capacity(dev->gd, NSECTORS);
+    snprintf(dev->gd->disk_name, DISK_NAME_LEN, DEVICE_NAME "%d", index);
+    set_capacity(dev->gd, dev->size >> SECTOR_SHIFT);
+
+    q = dev->gd->queue;
+    blk_queue_logical_block_size(q, logical_block_size);
+    blk_queue_physical_block_size(q, physical_block_size);
+
+    // discarded pages are freed, so advertise page-sized discard granularity
+    q->limits.discard_granularity = PAGE_SIZE;
+    blk_queue_max_discard_sectors(q, max_discard_sectors);
+    blk_queue_max_write_zeroes_sectors(q, max_discard_sectors);
+
+    ret = device_add_disk(NULL, dev->gd, vblock_attr_groups);
+    if (ret)
+        goto err_put_disk;
+
+    dev->dbg_dir = debugfs_create_dir(dev->gd->disk_name, vblock_dbg_root);
+    debugfs_create_file("latency_hist", 0600, dev->dbg_dir, &dev->lat, &vdrv_lathist_fops);
 
-    add_disk(dev->gd);
     return 0;
+
+err_put_disk:
+    put_disk(dev->gd);
+    dev->gd = NULL;
+    if (queue_mode == VBLK_Q_MQ)
+        vblock_free_mq(dev);
+err_free_lat:
+    vdrv_lathist_free(&dev->lat);
+    return ret;
 }
 
 static void vblock_destroy(struct vblock_dev *dev)
 {
-    if (dev->gd) {
-        del_gendisk(dev->gd);
-        put_disk(dev->gd);
-    }
+    if (!dev->gd)
+        return;
 
-    if (dev->queue)
-        blk_cleanup_queue(dev->queue);
+    debugfs_remove_recursive(dev->dbg_dir);
+    del_gendisk(dev->gd);
+    put_disk(dev->gd);
 
-    unregister_blkdev(VBLK_MAJOR, DEVICE_NAME);
+    if (queue_mode == VBLK_Q_MQ)
+        vblock_free_mq(dev);
 
-    if (dev->data)
-        vfree(dev->data);
+    rcu_barrier(); // wait for pages freed by discard
+    vblock_snap_free(dev);
+    vblock_free_pages(dev);
+    vdrv_lathist_free(&dev->lat);
+}
+
+static bool vblock_valid_block_size(unsigned int bs)
+{
+    return bs >= SECTOR_SIZE && bs <= PAGE_SIZE && is_power_of_2(bs);
 }
 
 static int __init vblock_init(void)
 {
-    int ret = vblock_create(&vblock);
-    if (ret)
-        return ret;
+    unsigned int i;
+    int ret;
+
+    if (queue_mode != VBLK_Q_BIO && queue_mode != VBLK_Q_MQ)
+        return -EINVAL;
+    if (!hw_queue_depth)
+        return -EINVAL;
+    if (!nr_devices || nr_devices > VBLK_MAX_DEVICES)
+        return -EINVAL;
+
+    if (!physical_block_size)
+        physical_block_size = logical_block_size;
+    if (!vblock_valid_block_size(logical_block_size) ||
+        !is_power_of_2(physical_block_size) ||
+        physical_block_size < logical_block_size)
+        return -EINVAL;
+
+    capacity = round_down(capacity, logical_block_size);
+    if (!capacity)
+        return -EINVAL;
+
+    for (i = 0; i < nr_devices; i++)
+        if (numa_node[i] != NUMA_NO_NODE &&
+            (numa_node[i] < 0 || numa_node[i] >= MAX_NUMNODES || !node_online(numa_node[i])))
+            return -EINVAL;
 
-    printk(KERN_INFO "vblock: virtual block device loaded\n");
+    vblock_devs = kcalloc(nr_devices, sizeof(*vblock_devs), GFP_KERNEL);
+    if (!vblock_devs)
+        return -ENOMEM;
+
+    if (register_blkdev(VBLK_MAJOR, DEVICE_NAME)) { // check if already registered
+        ret = -EBUSY;
+        goto err_free_devs;
+    }
+
+    vblock_dbg_root = debugfs_create_dir(DEVICE_NAME, NULL);
+
+    for (i = 0; i < nr_devices; i++) {
+        ret = vblock_create(&vblock_devs[i], i);
+        if (ret)
+            goto err_destroy;
+    }
+
+    if (queue_mode == VBLK_Q_BIO && poll_queues)
+        printk(KERN_WARNING "vblock: poll_queues is ignored in bio mode\n");
+
+    printk(KERN_INFO "vblock: %u virtual block device(s) loaded, %llu bytes, %u/%u block size, %s\n",
+           nr_devices, capacity, logical_block_size, physical_block_size,
+           queue_mode == VBLK_Q_BIO ? "bio mode" : "blk-mq");
     return 0;
+
+err_destroy:
+    while (i--)
+        vblock_destroy(&vblock_devs[i]);
+    debugfs_remove_recursive(vblock_dbg_root);
+    unregister_blkdev(VBLK_MAJOR, DEVICE_NAME);
+err_free_devs:
+    kfree(vblock_devs);
+    return ret;
 }
 
 static void __exit vblock_exit(void)
 {
-    vblock_destroy(&vblock);
+    unsigned int i;
+
+    for (i = 0; i < nr_devices; i++)
+        vblock_destroy(&vblock_devs[i]);
+
+    debugfs_remove_recursive(vblock_dbg_root);
+    unregister_blkdev(VBLK_MAJOR, DEVICE_NAME);
+    kfree(vblock_devs);
     printk(KERN_INFO "vblock: unloaded\n");
 }
 
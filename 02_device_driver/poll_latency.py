@@ -0,0 +1,87 @@
+#!/usr/bin/env python3
+"""Compare vblock QD1 read latency with and without polled completion.
+
+Load vblock with a poll queue, then run:
+
+    insmod device_driver.ko poll_queues=1
+    ./poll_latency.py                   # runs vblock_poll.fio, prints a table
+    ./poll_latency.py --json            # machine-readable output
+    ./poll_latency.py --input out.json  # report on an earlier fio --output-format=json run
+
+The "irq" job completes requests through the normal queues, "poll" sets
+hipri so io_uring polls vblock's HCTX_TYPE_POLL queues instead.
+"""
+
+import argparse
+import json
+import os
+import subprocess
+import sys
+
+JOBFILE = os.path.join(os.path.dirname(os.path.abspath(__file__)), "vblock_poll.fio")
+MODES = ("irq", "poll")
+PERCENTILES = ("50", "90", "99", "99.9", "99.99")
+
+
+def run_fio(jobfile):
+    try:
+        out = subprocess.run(["fio", "--output-format=json", jobfile],
+                             check=True, stdout=subprocess.PIPE).stdout
+    except FileNotFoundError:
+        sys.exit("fio not found")
+    except subprocess.CalledProcessError as e:
+        sys.exit("fio failed with status %d, see its output above" % e.returncode)
+    return json.loads(out)
+
+
+def summarise(job):
+    clat = job["read"]["clat_ns"]
+    pct = clat.get("percentile", {})
+    row = {
+        "mode": job["jobname"],
+        "iops": job["read"]["iops"],
+        "mean_ns": clat["mean"],
+        "max_ns": clat["max"],
+    }
+    for p in PERCENTILES:
+        row["p" + p + "_ns"] = pct.get("%.6f" % float(p), 0)
+    return row
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    ap.add_argument("--jobfile", default=JOBFILE, help="fio job file to run")
+    ap.add_argument("--input", help="parse this fio JSON output instead of running fio")
+    ap.add_argument("--json", action="store_true", help="print JSON instead of a table")
+    args = ap.parse_args()
+
+    if args.input:
+        with open(args.input) as f:
+            result = json.load(f)
+    else:
+        result = run_fio(args.jobfile)
+
+    jobs = {j["jobname"]: j for j in result["jobs"]}
+    missing = [m for m in MODES if m not in jobs]
+    if missing:
+        sys.exit("fio output has no %s job" % ", ".join(missing))
+    rows = [summarise(jobs[m]) for m in MODES]
+
+    if args.json:
+        print(json.dumps(rows, indent=2))
+        return
+
+    print("QD1 4k random read completion latency (ns)")
+    print("%-5s %10s %10s" % ("mode", "iops", "mean") +
+          "".join(" %10s" % ("p" + p) for p in PERCENTILES) + " %10s" % "max")
+    for r in rows:
+        print("%-5s %10.0f %10.0f" % (r["mode"], r["iops"], r["mean_ns"]) +
+              "".join(" %10d" % r["p" + p + "_ns"] for p in PERCENTILES) +
+              " %10d" % r["max_ns"])
+    irq, poll = rows
+    if irq["p99_ns"]:
+        print("poll p99 is %.1f%% of irq p99" % (100.0 * poll["p99_ns"] / irq["p99_ns"]))
+
+
+if __name__ == "__main__":
+    main()
@@ -2,94 +2,939 @@
 #include <linux/module.h>
 #include <linux/init.h>
 #include <linux/blkdev.h>
-#include <linux/genhd.h>
+#include <linux/blk-mq.h>
 #include <linux/vmalloc.h>
+#include <linux/highmem.h>
 #include <linux/hdreg.h>
 #include <linux/errno.h>
+#include <linux/crypto.h>
+#include <linux/percpu.h>
+#include <linux/slab.h>
+#include <linux/bit_spinlock.h>
+#include <linux/log2.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/fs.h>
+#include <linux/file.h>
+#include <linux/kthread.h>
+#include <linux/wait.h>
+#include <linux/bitmap.h>
+
+#include "vdrv_lathist.h"
 
 #define DEVICE_NAME "vdisk"
-#define VDISK_MAJOR 240
-#define NSECTORS 1024    // number of sectors
-#define SECTOR_SIZE 512  // 512 bytes per sector
+#define NSECTORS 1024    // number of 512 byte sectors
+
+static int numa_node = NUMA_NO_NODE;
+module_param(numa_node, int, 0444);
+MODULE_PARM_DESC(numa_node, "NUMA node for the backing memory and queue (default: -1, any node)");
+
+static bool compress;
+module_param(compress, bool, 0444);
+MODULE_PARM_DESC(compress, "Keep every 4K page compressed in RAM, zram style (default: off)");
+
+static char *comp_algorithm = "lz4";
+module_param(comp_algorithm, charp, 0444);
+MODULE_PARM_DESC(comp_algorithm, "Crypto API compressor used in compress mode (default: lz4)");
+
+static char *backing_file;
+module_param(backing_file, charp, 0444);
+MODULE_PARM_DESC(backing_file, "Persist the disk to this file through a write-back RAM cache; the file size sets the capacity");
+
+static unsigned int flush_interval_ms = 1000;
+module_param(flush_interval_ms, uint, 0444);
+MODULE_PARM_DESC(flush_interval_ms, "How often the flush thread writes dirty pages back (default: 1000)");
+
+static unsigned long max_dirty_pages = 1024;
+module_param(max_dirty_pages, ulong, 0444);
+MODULE_PARM_DESC(max_dirty_pages, "Dirty pages allowed before writers are throttled (default: 1024, tunable in sysfs)");
+
+// largest single kernel_write() issued by the flush thread, in pages
+#define VDISK_WB_BATCH 256
+
+// pages that do not compress below this are kept raw
+#define VDISK_HUGE_SIZE (PAGE_SIZE * 3 / 4)
+
+enum {
+    VDISK_SLOT_LOCK,  // bit spinlock protecting the slot
+    VDISK_SLOT_SAME,  // page is one repeated word, kept in ->value
+    VDISK_SLOT_HUGE,  // incompressible, ->buf holds the raw page
+};
+
+// one slot per 4K page in compress mode; an empty slot reads as zeroes
+struct vdisk_slot {
+    unsigned long flags;
+    unsigned int len;               // bytes held in ->buf
+    union {
+        void *buf;
+        unsigned long value;
+    };
+};
+
+// per-CPU compressor and scratch space, used with preemption disabled
+struct vdisk_zstrm {
+    struct crypto_comp *tfm;
+    u8 *page;                       // read-modify-write of partial pages
+    u8 *cbuf;                       // compressor output
+};
 
 struct vdisk_dev {
-    int size;                  // device size in bytes
-    u8 *data;                  // memory to store disk data
-    struct request_queue *queue;
+    u64 size;                       // device size in bytes
+    u8 *data;                       // memory to store disk data
+    struct vdisk_slot *slots;       // compress mode backing store
+    atomic64_t pages_stored;        // compress mode statistics
+    atomic64_t compr_data_size;
+    atomic64_t same_pages;
+    struct file *file;              // backing file in write-back mode
+    unsigned long *dirty;           // one bit per page not yet written back
+    atomic_long_t dirty_pages;
+    unsigned long max_dirty;
+    struct mutex flush_lock;        // one write-back pass at a time
+    struct task_struct *flushd;
+    wait_queue_head_t flush_wait;   // wakes the flush thread
+    wait_queue_head_t dirty_wait;   // throttled writers
+    atomic64_t flushed_bytes;
+    u64 flush_kbps;                 // throughput of the last write-back pass
+    struct blk_mq_tag_set tag_set;
     struct gendisk *gd;
+    struct vdrv_lathist lat;        // per-CPU, see vdrv_lathist.h
+    struct dentry *dbg_dir;
 };
 
+static int vdisk_major;
 static struct vdisk_dev vdisk;
+static struct vdisk_zstrm __percpu *vdisk_zstrm;
 
-// Request handler
-static void vdisk_request(struct request_queue *q) {
-    struct request *req; // one blocl input / output req 
-    while ((req = blk_fetch_request(q)) != NULL) {
-        sector_t sector = blk_rq_pos(req); // the sector size
-        unsigned int sectors = blk_rq_sectors(req); // the sector 
-        struct bio_vec bv; // this is the memory segment 
-        struct req_iterator iter; // iteration
-
-        rq_for_each_segment(bv, req, iter) { //ever sector the memory segment , request block all taken with them
-            char *buffer = kmap(bv.bv_page) + bv.bv_offset; // maps the physical memory to the virtual memoty and buffer is the pointer to that memory
-
-            if (rq_data_dir(req) == WRITE) { // req_data_dir - tells the direction
-                memcpy(vdisk.data + sector*SECTOR_SIZE, buffer, sectors*SECTOR_SIZE); //kernel buffer to virtual disk
-            } else {
-                memcpy(buffer, vdisk.data + sector*SECTOR_SIZE, sectors*SECTOR_SIZE); // virtual disk to kernel buffer 
+static inline void vdisk_copy(struct vdisk_dev *dev, loff_t pos, char *buffer,
+                              unsigned int len, bool write)
+{
+    if (write)
+        memcpy(dev->data + pos, buffer, len); //kernel buffer to virtual disk
+    else
+        memcpy(buffer, dev->data + pos, len); // virtual disk to kernel buffer
+}
+
+// highmem pages have no permanent mapping, so copy one page segment at a time
+static void vdisk_transfer_highmem(struct vdisk_dev *dev, struct request *req,
+                                   loff_t pos, bool write)
+{
+    struct bio_vec bv; // this is the memory segment
+    struct req_iterator iter; // iteration
+
+    rq_for_each_segment(bv, req, iter) {
+        char *buffer = bvec_kmap_local(&bv);
+
+        vdisk_copy(dev, pos, buffer, bv.bv_len, write);
+        kunmap_local(buffer);
+        pos += bv.bv_len; // the next segment continues where this one ended
+    }
+}
+
+/*
+ * Walk the request one multi-page bvec at a time, advancing the disk
+ * offset by each segment's length. Segments that follow each other in
+ * the kernel's linear mapping are merged into a single memcpy.
+ */
+static void vdisk_transfer(struct vdisk_dev *dev, struct request *req,
+                           loff_t pos, bool write)
+{
+    struct bio_vec bv;
+    struct req_iterator iter;
+    char *run = NULL;
+    unsigned int run_len = 0;
+
+    rq_for_each_bvec(bv, req, iter) {
+        char *buffer = bvec_virt(&bv);
+
+        if (run_len && buffer == run + run_len) {
+            run_len += bv.bv_len;
+            continue;
+        }
+
+        if (run_len) {
+            vdisk_copy(dev, pos, run, run_len, write);
+            pos += run_len;
+        }
+        run = buffer;
+        run_len = bv.bv_len;
+    }
+
+    if (run_len)
+        vdisk_copy(dev, pos, run, run_len, write);
+}
+
+/*
+ * Write-back mode: the flat RAM buffer acts as a cache in front of
+ * backing_file. Writes only mark pages dirty; the flush thread writes
+ * them back in offset order, one kernel_write() per run of adjacent
+ * dirty pages. A page's bit is cleared before its data is read, so a
+ * write that races with the flush simply dirties the page again.
+ */
+static int vdisk_writeback_range(struct vdisk_dev *dev, pgoff_t first, pgoff_t last)
+{
+    u64 t0 = ktime_get_ns(), bytes = 0, ns;
+    pgoff_t start = first, end, i;
+    int ret = 0;
+
+    mutex_lock(&dev->flush_lock);
+    for (;;) {
+        loff_t pos;
+        size_t len;
+        ssize_t written;
+
+        start = find_next_bit(dev->dirty, last, start);
+        if (start >= last)
+            break;
+        end = find_next_zero_bit(dev->dirty, min(last, start + VDISK_WB_BATCH), start);
+
+        for (i = start; i < end; i++)
+            if (test_and_clear_bit(i, dev->dirty))
+                atomic_long_dec(&dev->dirty_pages);
+
+        pos = (loff_t)start << PAGE_SHIFT;
+        len = (end - start) << PAGE_SHIFT;
+        written = kernel_write(dev->file, dev->data + pos, len, &pos);
+        if (written != len) {
+            for (i = start; i < end; i++) // keep them for the next pass
+                if (!test_and_set_bit(i, dev->dirty))
+                    atomic_long_inc(&dev->dirty_pages);
+            ret = written < 0 ? written : -EIO;
+            break;
+        }
+
+        bytes += len;
+        start = end;
+    }
+
+    if (bytes) {
+        ns = ktime_get_ns() - t0;
+        atomic64_add(bytes, &dev->flushed_bytes);
+        WRITE_ONCE(dev->flush_kbps, div64_u64(bytes * NSEC_PER_SEC, max_t(u64, ns, 1) * 1024));
+    }
+    mutex_unlock(&dev->flush_lock);
+
+    wake_up_all(&dev->dirty_wait);
+    return ret;
+}
+
+static int vdisk_writeback(struct vdisk_dev *dev)
+{
+    return vdisk_writeback_range(dev, 0, dev->size >> PAGE_SHIFT);
+}
+
+// REQ_PREFLUSH / REQ_OP_FLUSH: everything acknowledged so far must be durable
+static blk_status_t vdisk_sync(struct vdisk_dev *dev)
+{
+    if (vdisk_writeback(dev) || vfs_fsync(dev->file, 0))
+        return BLK_STS_IOERR;
+    return BLK_STS_OK;
+}
+
+// REQ_FUA: this write must be durable before it completes
+static blk_status_t vdisk_sync_range(struct vdisk_dev *dev, loff_t pos, unsigned int len)
+{
+    if (vdisk_writeback_range(dev, pos >> PAGE_SHIFT, DIV_ROUND_UP_ULL(pos + len, PAGE_SIZE)) ||
+        vfs_fsync_range(dev->file, pos, pos + len - 1, 1))
+        return BLK_STS_IOERR;
+    return BLK_STS_OK;
+}
+
+// dirty pages that wake the flush thread early; at least one, so it can sleep
+static inline unsigned long vdisk_flush_threshold(struct vdisk_dev *dev)
+{
+    return max(READ_ONCE(dev->max_dirty) / 2, 1UL);
+}
+
+// called after the data is in the cache; may sleep (BLK_MQ_F_BLOCKING)
+static void vdisk_mark_dirty(struct vdisk_dev *dev, loff_t pos, unsigned int len)
+{
+    pgoff_t i, last = DIV_ROUND_UP_ULL(pos + len, PAGE_SIZE);
+
+    smp_mb__before_atomic(); // data before the bit, pairs with test_and_clear_bit()
+    for (i = pos >> PAGE_SHIFT; i < last; i++)
+        if (!test_and_set_bit(i, dev->dirty))
+            atomic_long_inc(&dev->dirty_pages);
+
+    if (atomic_long_read(&dev->dirty_pages) >= vdisk_flush_threshold(dev))
+        wake_up(&dev->flush_wait);
+
+    // throttle, but never for longer than one flush interval if write-back is failing
+    wait_event_timeout(dev->dirty_wait,
+                       atomic_long_read(&dev->dirty_pages) < READ_ONCE(dev->max_dirty),
+                       msecs_to_jiffies(flush_interval_ms));
+}
+
+static int vdisk_flushd(void *data)
+{
+    struct vdisk_dev *dev = data;
+
+    while (!kthread_should_stop()) {
+        wait_event_interruptible_timeout(dev->flush_wait,
+            kthread_should_stop() ||
+            atomic_long_read(&dev->dirty_pages) >= vdisk_flush_threshold(dev),
+            msecs_to_jiffies(flush_interval_ms));
+
+        if (vdisk_writeback(dev)) {
+            pr_err_ratelimited("vdisk: write-back to %s failed\n", backing_file);
+            // back off a full interval, the pages stay dirty and would wake us at once
+            schedule_timeout_interruptible(msecs_to_jiffies(flush_interval_ms));
+        }
+    }
+    return 0;
+}
+
+static inline void vdisk_slot_lock(struct vdisk_slot *slot)
+{
+    bit_spin_lock(VDISK_SLOT_LOCK, &slot->flags);
+}
+
+static inline void vdisk_slot_unlock(struct vdisk_slot *slot)
+{
+    bit_spin_unlock(VDISK_SLOT_LOCK, &slot->flags);
+}
+
+static bool vdisk_page_same_filled(const void *ptr, unsigned long *value)
+{
+    const unsigned long *page = ptr;
+    unsigned long val = page[0];
+    unsigned int i;
+
+    for (i = 1; i < PAGE_SIZE / sizeof(*page); i++)
+        if (page[i] != val)
+            return false;
+
+    *value = val;
+    return true;
+}
+
+// drop whatever the slot holds; called with the slot locked
+static void vdisk_slot_free(struct vdisk_dev *dev, struct vdisk_slot *slot)
+{
+    if (test_and_clear_bit(VDISK_SLOT_SAME, &slot->flags)) {
+        atomic64_dec(&dev->same_pages);
+        atomic64_dec(&dev->pages_stored);
+        slot->value = 0;
+        return;
+    }
+
+    if (!slot->buf)
+        return;
+
+    atomic64_sub(slot->len, &dev->compr_data_size);
+    atomic64_dec(&dev->pages_stored);
+    clear_bit(VDISK_SLOT_HUGE, &slot->flags);
+    kfree(slot->buf);
+    slot->buf = NULL;
+    slot->len = 0;
+}
+
+// decompress a slot into a full page buffer; called with the slot locked
+static int vdisk_slot_load(struct vdisk_zstrm *zs, struct vdisk_slot *slot, u8 *dst)
+{
+    unsigned int dlen = PAGE_SIZE;
+
+    if (test_bit(VDISK_SLOT_SAME, &slot->flags)) {
+        memset_l((unsigned long *)dst, slot->value, PAGE_SIZE / sizeof(unsigned long));
+        return 0;
+    }
+    if (!slot->buf) {
+        memset(dst, 0, PAGE_SIZE);
+        return 0;
+    }
+    if (test_bit(VDISK_SLOT_HUGE, &slot->flags)) {
+        memcpy(dst, slot->buf, PAGE_SIZE);
+        return 0;
+    }
+
+    if (crypto_comp_decompress(zs->tfm, slot->buf, slot->len, dst, &dlen) ||
+        dlen != PAGE_SIZE)
+        return -EIO;
+    return 0;
+}
+
+// compress a full page into the slot; called with the slot locked
+static int vdisk_slot_store(struct vdisk_dev *dev, struct vdisk_zstrm *zs,
+                            struct vdisk_slot *slot, const u8 *src)
+{
+    unsigned int clen = 2 * PAGE_SIZE;
+    unsigned long value;
+    const u8 *from = zs->cbuf;
+    bool huge = false;
+    void *buf;
+
+    if (vdisk_page_same_filled(src, &value)) {
+        vdisk_slot_free(dev, slot);
+        slot->value = value;
+        set_bit(VDISK_SLOT_SAME, &slot->flags);
+        atomic64_inc(&dev->same_pages);
+        atomic64_inc(&dev->pages_stored);
+        return 0;
+    }
+
+    if (crypto_comp_compress(zs->tfm, src, PAGE_SIZE, zs->cbuf, &clen) ||
+        clen >= VDISK_HUGE_SIZE) {
+        from = src;
+        clen = PAGE_SIZE;
+        huge = true;
+    }
+
+    buf = kmalloc(clen, GFP_ATOMIC | __GFP_NOWARN);
+    if (!buf)
+        return -ENOMEM;
+    memcpy(buf, from, clen);
+
+    vdisk_slot_free(dev, slot);
+    slot->buf = buf;
+    slot->len = clen;
+    if (huge)
+        set_bit(VDISK_SLOT_HUGE, &slot->flags);
+    atomic64_add(clen, &dev->compr_data_size);
+    atomic64_inc(&dev->pages_stored);
+    return 0;
+}
+
+// read or write len bytes at off inside one page of the compressed store
+static int vdisk_zcopy(struct vdisk_dev *dev, pgoff_t idx, unsigned int off,
+                       char *buffer, unsigned int len, bool write)
+{
+    struct vdisk_slot *slot = &dev->slots[idx];
+    struct vdisk_zstrm *zs = get_cpu_ptr(vdisk_zstrm);
+    bool whole = off == 0 && len == PAGE_SIZE;
+    int ret = 0;
+
+    vdisk_slot_lock(slot);
+    if (write) {
+        if (!whole) { // partial page: decompress, patch, recompress
+            ret = vdisk_slot_load(zs, slot, zs->page);
+            if (!ret) {
+                memcpy(zs->page + off, buffer, len);
+                ret = vdisk_slot_store(dev, zs, slot, zs->page);
             }
+        } else {
+            ret = vdisk_slot_store(dev, zs, slot, buffer);
+        }
+    } else {
+        if (whole) {
+            ret = vdisk_slot_load(zs, slot, buffer);
+        } else {
+            ret = vdisk_slot_load(zs, slot, zs->page);
+            if (!ret)
+                memcpy(buffer, zs->page + off, len);
+        }
+    }
+    vdisk_slot_unlock(slot);
+    put_cpu_ptr(vdisk_zstrm);
+
+    return ret;
+}
+
+static blk_status_t vdisk_transfer_compressed(struct vdisk_dev *dev, struct request *req,
+                                              loff_t pos, bool write)
+{
+    struct bio_vec bv;
+    struct req_iterator iter;
+
+    rq_for_each_segment(bv, req, iter) {
+        char *buffer = bvec_kmap_local(&bv);
+        unsigned int done = 0;
+        int ret = 0;
 
-            kunmap(bv.bv_page);
+        while (done < bv.bv_len) {
+            unsigned int off = offset_in_page(pos);
+            unsigned int chunk = min_t(unsigned int, bv.bv_len - done, PAGE_SIZE - off);
+
+            ret = vdisk_zcopy(dev, pos >> PAGE_SHIFT, off, buffer + done, chunk, write);
+            if (ret)
+                break;
+            done += chunk;
+            pos += chunk;
         }
+        kunmap_local(buffer);
 
-        __blk_end_request_all(req, 0);
+        if (ret == -ENOMEM)
+            return BLK_STS_RESOURCE;
+        if (ret)
+            return BLK_STS_IOERR;
     }
+
+    return BLK_STS_OK;
+}
+
+// Request handler
+static blk_status_t vdisk_queue_rq(struct blk_mq_hw_ctx *hctx,
+                                   const struct blk_mq_queue_data *bd)
+{
+    struct request *req = bd->rq; // one block input / output req
+    struct vdisk_dev *dev = hctx->queue->queuedata;
+    sector_t sector = blk_rq_pos(req); // the first sector
+    blk_status_t status = BLK_STS_OK;
+    u64 start = ktime_get_ns();
+    bool write;
+
+    blk_mq_start_request(req);
+
+    switch (req_op(req)) {
+    case REQ_OP_READ:
+        write = false;
+        break;
+    case REQ_OP_WRITE:
+        write = true;
+        break;
+    case REQ_OP_FLUSH:
+        if (dev->file)
+            status = vdisk_sync(dev);
+        goto out;
+    default:
+        status = BLK_STS_NOTSUPP;
+        goto out;
+    }
+
+    // reject anything that runs past the end of the disk before touching memory
+    if (sector + blk_rq_sectors(req) > get_capacity(dev->gd)) {
+        status = BLK_STS_IOERR;
+        goto out;
+    }
+
+    if (compress) {
+        status = vdisk_transfer_compressed(dev, req, (loff_t)sector << SECTOR_SHIFT, write);
+        if (status == BLK_STS_RESOURCE)
+            return status; // let blk-mq retry once memory frees up
+    } else if (IS_ENABLED(CONFIG_HIGHMEM))
+        vdisk_transfer_highmem(dev, req, (loff_t)sector << SECTOR_SHIFT, write);
+    else
+        vdisk_transfer(dev, req, (loff_t)sector << SECTOR_SHIFT, write);
+
+    if (dev->file && write) {
+        loff_t pos = (loff_t)sector << SECTOR_SHIFT;
+
+        vdisk_mark_dirty(dev, pos, blk_rq_bytes(req));
+        if (req->cmd_flags & REQ_FUA)
+            status = vdisk_sync_range(dev, pos, blk_rq_bytes(req));
+    }
+
+out:
+    vdrv_lathist_account(&dev->lat, req_op(req), blk_rq_bytes(req), start);
+    blk_mq_end_request(req, status);
+    return BLK_STS_OK;
+}
+
+static const struct blk_mq_ops vdisk_mq_ops = {
+    .queue_rq = vdisk_queue_rq,
+};
+
+static const struct block_device_operations vdisk_fops = {
+    .owner = THIS_MODULE,
+};
+
+// compress mode statistics, /sys/block/vdisk/<name>
+static ssize_t orig_data_size_show(struct device *dev, struct device_attribute *attr,
+                                   char *buf)
+{
+    struct vdisk_dev *vd = dev_to_disk(dev)->private_data;
+
+    return sysfs_emit(buf, "%llu\n", (u64)atomic64_read(&vd->pages_stored) << PAGE_SHIFT);
+}
+static DEVICE_ATTR_RO(orig_data_size);
+
+static ssize_t compr_data_size_show(struct device *dev, struct device_attribute *attr,
+                                    char *buf)
+{
+    struct vdisk_dev *vd = dev_to_disk(dev)->private_data;
+
+    return sysfs_emit(buf, "%llu\n", (u64)atomic64_read(&vd->compr_data_size));
+}
+static DEVICE_ATTR_RO(compr_data_size);
+
+static ssize_t same_pages_show(struct device *dev, struct device_attribute *attr,
+                               char *buf)
+{
+    struct vdisk_dev *vd = dev_to_disk(dev)->private_data;
+
+    return sysfs_emit(buf, "%llu\n", (u64)atomic64_read(&vd->same_pages));
+}
+static DEVICE_ATTR_RO(same_pages);
+
+static struct attribute *vdisk_compress_attrs[] = {
+    &dev_attr_orig_data_size.attr,
+    &dev_attr_compr_data_size.attr,
+    &dev_attr_same_pages.attr,
+    NULL,
+};
+
+static umode_t vdisk_compress_attr_visible(struct kobject *kobj, struct attribute *attr, int n)
+{
+    return compress ? attr->mode : 0;
+}
+
+static const struct attribute_group vdisk_compress_group = {
+    .attrs = vdisk_compress_attrs,
+    .is_visible = vdisk_compress_attr_visible,
+};
+
+// one row per operation, summed over size classes and CPUs
+static ssize_t latency_hist_show(struct device *dev, struct device_attribute *attr,
+                                 char *buf)
+{
+    struct vdisk_dev *vd = dev_to_disk(dev)->private_data;
+
+    return vdrv_lathist_format(&vd->lat, buf);
+}
+static DEVICE_ATTR_RO(latency_hist);
+
+static struct attribute *vdisk_attrs[] = {
+    &dev_attr_latency_hist.attr,
+    NULL,
+};
+
+static const struct attribute_group vdisk_attr_group = {
+    .attrs = vdisk_attrs,
+};
+
+// write-back mode statistics and tuning
+static ssize_t dirty_pages_show(struct device *dev, struct device_attribute *attr,
+                                char *buf)
+{
+    struct vdisk_dev *vd = dev_to_disk(dev)->private_data;
+
+    return sysfs_emit(buf, "%ld\n", atomic_long_read(&vd->dirty_pages));
+}
+static DEVICE_ATTR_RO(dirty_pages);
+
+static ssize_t max_dirty_pages_show(struct device *dev, struct device_attribute *attr,
+                                    char *buf)
+{
+    struct vdisk_dev *vd = dev_to_disk(dev)->private_data;
+
+    return sysfs_emit(buf, "%lu\n", READ_ONCE(vd->max_dirty));
+}
+
+static ssize_t max_dirty_pages_store(struct device *dev, struct device_attribute *attr,
+                                     const char *buf, size_t count)
+{
+    struct vdisk_dev *vd = dev_to_disk(dev)->private_data;
+    unsigned long value;
+
+    if (kstrtoul(buf, 10, &value) || !value)
+        return -EINVAL;
+
+    WRITE_ONCE(vd->max_dirty, value);
+    wake_up(&vd->flush_wait);
+    wake_up_all(&vd->dirty_wait);
+    return count;
+}
+static DEVICE_ATTR_RW(max_dirty_pages);
+
+static ssize_t flushed_bytes_show(struct device *dev, struct device_attribute *attr,
+                                  char *buf)
+{
+    struct vdisk_dev *vd = dev_to_disk(dev)->private_data;
+
+    return sysfs_emit(buf, "%llu\n", (u64)atomic64_read(&vd->flushed_bytes));
+}
+static DEVICE_ATTR_RO(flushed_bytes);
+
+static ssize_t flush_kbps_show(struct device *dev, struct device_attribute *attr,
+                               char *buf)
+{
+    struct vdisk_dev *vd = dev_to_disk(dev)->private_data;
+
+    return sysfs_emit(buf, "%llu\n", READ_ONCE(vd->flush_kbps));
+}
+static DEVICE_ATTR_RO(flush_kbps);
+
+static struct attribute *vdisk_writeback_attrs[] = {
+    &dev_attr_dirty_pages.attr,
+    &dev_attr_max_dirty_pages.attr,
+    &dev_attr_flushed_bytes.attr,
+    &dev_attr_flush_kbps.attr,
+    NULL,
+};
+
+static umode_t vdisk_writeback_attr_visible(struct kobject *kobj, struct attribute *attr, int n)
+{
+    return backing_file ? attr->mode : 0;
+}
+
+static const struct attribute_group vdisk_writeback_group = {
+    .attrs = vdisk_writeback_attrs,
+    .is_visible = vdisk_writeback_attr_visible,
+};
+
+static const struct attribute_group *vdisk_attr_groups[] = {
+    &vdisk_attr_group,
+    &vdisk_compress_group,
+    &vdisk_writeback_group,
+    NULL,
+};
+
+static void vdisk_free_zstrm(void)
+{
+    int cpu;
+
+    if (!vdisk_zstrm)
+        return;
+
+    for_each_possible_cpu(cpu) {
+        struct vdisk_zstrm *zs = per_cpu_ptr(vdisk_zstrm, cpu);
+
+        if (!IS_ERR_OR_NULL(zs->tfm))
+            crypto_free_comp(zs->tfm);
+        kfree(zs->page);
+        kfree(zs->cbuf);
+    }
+    free_percpu(vdisk_zstrm);
+    vdisk_zstrm = NULL;
+}
+
+static int vdisk_alloc_zstrm(void)
+{
+    int cpu;
+
+    vdisk_zstrm = alloc_percpu(struct vdisk_zstrm);
+    if (!vdisk_zstrm)
+        return -ENOMEM;
+
+    for_each_possible_cpu(cpu) {
+        struct vdisk_zstrm *zs = per_cpu_ptr(vdisk_zstrm, cpu);
+
+        zs->tfm = crypto_alloc_comp(comp_algorithm, 0, 0);
+        if (IS_ERR(zs->tfm)) {
+            int ret = PTR_ERR(zs->tfm);
+
+            vdisk_free_zstrm();
+            return ret;
+        }
+
+        zs->page = kmalloc_node(PAGE_SIZE, GFP_KERNEL, cpu_to_node(cpu));
+        zs->cbuf = kmalloc_node(2 * PAGE_SIZE, GFP_KERNEL, cpu_to_node(cpu));
+        if (!zs->page || !zs->cbuf) {
+            vdisk_free_zstrm();
+            return -ENOMEM;
+        }
+    }
+    return 0;
+}
+
+static void vdisk_free_slots(struct vdisk_dev *dev)
+{
+    pgoff_t i;
+
+    if (!dev->slots)
+        return;
+
+    for (i = 0; i < dev->size >> PAGE_SHIFT; i++)
+        vdisk_slot_free(dev, &dev->slots[i]);
+    vfree(dev->slots);
+    dev->slots = NULL;
+}
+
+// open the backing file, size the disk from it and load it into the cache
+static int vdisk_open_backing_file(struct vdisk_dev *dev)
+{
+    loff_t pos = 0;
+    int ret;
+
+    dev->file = filp_open(backing_file, O_RDWR | O_LARGEFILE, 0);
+    if (IS_ERR(dev->file)) {
+        ret = PTR_ERR(dev->file);
+        dev->file = NULL;
+        printk(KERN_ERR "vdisk: cannot open %s (%d)\n", backing_file, ret);
+        return ret;
+    }
+
+    dev->size = round_down(i_size_read(file_inode(dev->file)), PAGE_SIZE);
+    if (!dev->size) {
+        ret = -EINVAL;
+        goto err_fput;
+    }
+
+    dev->data = vmalloc_node(dev->size, numa_node);
+    dev->dirty = bitmap_zalloc(dev->size >> PAGE_SHIFT, GFP_KERNEL);
+    if (!dev->data || !dev->dirty) {
+        ret = -ENOMEM;
+        goto err_free;
+    }
+
+    while (pos < dev->size) {
+        ssize_t n = kernel_read(dev->file, dev->data + pos, dev->size - pos, &pos);
+
+        if (n <= 0) {
+            ret = n < 0 ? n : -EIO;
+            goto err_free;
+        }
+    }
+
+    mutex_init(&dev->flush_lock);
+    init_waitqueue_head(&dev->flush_wait);
+    init_waitqueue_head(&dev->dirty_wait);
+    dev->max_dirty = max_dirty_pages;
+
+    dev->flushd = kthread_run(vdisk_flushd, dev, "vdisk_flushd");
+    if (IS_ERR(dev->flushd)) {
+        ret = PTR_ERR(dev->flushd);
+        dev->flushd = NULL;
+        goto err_free;
+    }
+    return 0;
+
+err_free:
+    bitmap_free(dev->dirty);
+    dev->dirty = NULL;
+    vfree(dev->data);
+    dev->data = NULL;
+err_fput:
+    fput(dev->file);
+    dev->file = NULL;
+    return ret;
+}
+
+// stop the flush thread and make everything durable before letting go of the file
+static void vdisk_close_backing_file(struct vdisk_dev *dev)
+{
+    if (!dev->file)
+        return;
+
+    kthread_stop(dev->flushd);
+    if (vdisk_sync(dev))
+        printk(KERN_ERR "vdisk: final write-back to %s failed\n", backing_file);
+    bitmap_free(dev->dirty);
+    dev->dirty = NULL;
+    fput(dev->file);
+    dev->file = NULL;
+}
+
+// backing store: one flat buffer, a file-backed cache, or a slot table plus compressors
+static int vdisk_alloc_store(struct vdisk_dev *dev)
+{
+    int ret;
+
+    if (backing_file)
+        return vdisk_open_backing_file(dev);
+
+    if (!compress) {
+        dev->data = vmalloc_node(dev->size, numa_node);
+        if (!dev->data)
+            return -ENOMEM;
+        memset(dev->data, 0, dev->size);
+        return 0;
+    }
+
+    if (!IS_ALIGNED(dev->size, PAGE_SIZE))
+        return -EINVAL;
+
+    dev->slots = vzalloc_node((dev->size >> PAGE_SHIFT) * sizeof(*dev->slots), numa_node);
+    if (!dev->slots)
+        return -ENOMEM;
+
+    ret = vdisk_alloc_zstrm();
+    if (ret) {
+        vfree(dev->slots);
+        dev->slots = NULL;
+        printk(KERN_ERR "vdisk: cannot set up %s compression\n", comp_algorithm);
+    }
+    return ret;
+}
+
+static void vdisk_free_store(struct vdisk_dev *dev)
+{
+    vdisk_close_backing_file(dev);
+    vdisk_free_slots(dev);
+    vdisk_free_zstrm();
+    vfree(dev->data);
+    dev->data = NULL;
 }
 
 // Module init
 static int __init vdisk_init(void) {
+    int ret;
+
     printk(KERN_INFO "vdisk: Initializing virtual disk\n");
 
-    // Allocate memory for disk
-    vdisk.size = NSECTORS * SECTOR_SIZE;
-    vdisk.data = vmalloc(vdisk.size);
-    if (!vdisk.data)
-        return -ENOMEM;
-    memset(vdisk.data, 0, vdisk.size);
+    if (numa_node != NUMA_NO_NODE &&
+        (numa_node < 0 || numa_node >= MAX_NUMNODES || !node_online(numa_node)))
+        return -EINVAL;
+    if (backing_file && compress)
+        return -EINVAL;
+    if (!max_dirty_pages)
+        return -EINVAL;
 
-    // Initialize request queue
-    vdisk.queue = blk_init_queue(vdisk_request, NULL);
-    if (!vdisk.queue) {
-        vfree(vdisk.data);
-        return -ENOMEM;
+    // Allocate memory for disk on the requested node; a backing file sets its own size
+    vdisk.size = (u64)NSECTORS << SECTOR_SHIFT;
+    ret = vdisk_alloc_store(&vdisk);
+    if (ret)
+        return ret;
+
+    ret = vdrv_lathist_init(&vdisk.lat);
+    if (ret)
+        goto err_free_data;
+
+    vdisk_major = register_blkdev(0, DEVICE_NAME);
+    if (vdisk_major < 0) {
+        ret = vdisk_major;
+        goto err_free_data;
     }
 
+    // Initialize the tag set and request queue
+    vdisk.tag_set.ops = &vdisk_mq_ops;
+    vdisk.tag_set.nr_hw_queues = 1;
+    vdisk.tag_set.queue_depth = 128;
+    vdisk.tag_set.numa_node = numa_node;
+    vdisk.tag_set.flags = BLK_MQ_F_SHOULD_MERGE;
+    if (vdisk.file)
+        vdisk.tag_set.flags |= BLK_MQ_F_BLOCKING; // throttling and FUA sleep
+    ret = blk_mq_alloc_tag_set(&vdisk.tag_set);
+    if (ret)
+        goto err_unregister;
+
     // Initialize gendisk structure
-    vdisk.gd = alloc_disk(1);
-    if (!vdisk.gd) {
-        blk_cleanup_queue(vdisk.queue);
-        vfree(vdisk.data);
-        return -ENOMEM;
+    vdisk.gd = blk_mq_alloc_disk(&vdisk.tag_set, &vdisk);
+    if (IS_ERR(vdisk.gd)) {
+        ret = PTR_ERR(vdisk.gd);
+        goto err_free_tags;
     }
 
-    vdisk.gd->major = VDISK_MAJOR;
+    vdisk.gd->major = vdisk_major;
     vdisk.gd->first_minor = 0;
-    vdisk.gd->fops = NULL; // no special ops
-    vdisk.gd->queue = vdisk.queue;
+    vdisk.gd->minors = 1;
+    vdisk.gd->fops = &vdisk_fops;
+    vdisk.gd->private_data = &vdisk;
     strcpy(vdisk.gd->disk_name, DEVICE_NAME);
-    set_capacity(vdisk.gd, NSECTORS);
-    add_disk(vdisk.gd);
+    set_capacity(vdisk.gd, vdisk.size >> SECTOR_SHIFT);
+    if (vdisk.file)
+        blk_queue_write_cache(vdisk.gd->queue, true, true); // we want PREFLUSH and FUA
+
+    ret = device_add_disk(NULL, vdisk.gd, vdisk_attr_groups);
+    if (ret)
+        goto err_put_disk;
 
-    printk(KERN_INFO "vdisk: Virtual disk registered as /dev/%s\n", DEVICE_NAME);
+    vdisk.dbg_dir = debugfs_create_dir(DEVICE_NAME, NULL);
+    debugfs_create_file("latency_hist", 0600, vdisk.dbg_dir, &vdisk.lat, &vdrv_lathist_fops);
+
+    printk(KERN_INFO "vdisk: Virtual disk registered as /dev/%s%s\n", DEVICE_NAME,
+           compress ? " (compressed)" : "");
     return 0;
+
+err_put_disk:
+    put_disk(vdisk.gd);
+err_free_tags:
+    blk_mq_free_tag_set(&vdisk.tag_set);
+err_unregister:
+    unregister_blkdev(vdisk_major, DEVICE_NAME);
+err_free_data:
+    vdrv_lathist_free(&vdisk.lat);
+    vdisk_free_store(&vdisk);
+    return ret;
 }
 
 // Module exit
 static void __exit vdisk_exit(void) {
+    debugfs_remove_recursive(vdisk.dbg_dir);
     del_gendisk(vdisk.gd);
     put_disk(vdisk.gd);
-    blk_cleanup_queue(vdisk.queue);
-    vfree(vdisk.data);
+    blk_mq_free_tag_set(&vdisk.tag_set);
+    unregister_blkdev(vdisk_major, DEVICE_NAME);
+    vdrv_lathist_free(&vdisk.lat);
+    vdisk_free_store(&vdisk);
     printk(KERN_INFO "vdisk: Virtual disk unregistered\n");
 }
 
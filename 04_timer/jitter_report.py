@@ -0,0 +1,119 @@
+#!/usr/bin/env python3
+"""Summarise timer_driver's hrtimer jitter self-test.
+
+Load the module in self-test mode, let it run, then report:
+
+    insmod timer_request.ko selftest_period_us=1000
+    sleep 60
+    ./jitter_report.py            # per-CPU table plus an all-CPU row
+    ./jitter_report.py --reset    # clear the histograms after reporting
+    ./jitter_report.py --json     # machine-readable output
+
+Each histogram bucket b counts expiries that ran [2^(b-1), 2^b) ns late,
+so the percentiles reported here are upper bounds within a factor of two.
+"""
+
+import argparse
+import json
+import sys
+
+DEFAULT_PATH = "/sys/kernel/debug/timer_driver/jitter_hist"
+
+
+def parse(text):
+    period_us = None
+    cpus = []
+    for line in text.splitlines():
+        if line.startswith("# period_us"):
+            period_us = int(line.split()[2])
+            continue
+        if not line or line.startswith("#"):
+            continue
+        fields = [int(f) for f in line.split()]
+        cpu, samples, missed, sum_ns, max_ns = fields[:5]
+        cpus.append({
+            "cpu": cpu,
+            "samples": samples,
+            "missed": missed,
+            "sum_ns": sum_ns,
+            "max_ns": max_ns,
+            "hist": fields[5:],
+        })
+    return period_us, cpus
+
+
+def bucket_upper_ns(b):
+    return 0 if b == 0 else 1 << b
+
+
+def percentile(hist, samples, p):
+    if not samples:
+        return 0
+    rank = samples * p / 100.0
+    seen = 0
+    for b, count in enumerate(hist):
+        seen += count
+        if seen >= rank:
+            return bucket_upper_ns(b)
+    return bucket_upper_ns(len(hist) - 1)
+
+
+def summarise(row):
+    n = row["samples"]
+    return {
+        "cpu": row["cpu"],
+        "samples": n,
+        "missed": row["missed"],
+        "mean_ns": row["sum_ns"] / n if n else 0.0,
+        "p50_ns": percentile(row["hist"], n, 50),
+        "p99_ns": percentile(row["hist"], n, 99),
+        "p999_ns": percentile(row["hist"], n, 99.9),
+        "max_ns": row["max_ns"],
+    }
+
+
+def merge(cpus):
+    nbuckets = max((len(c["hist"]) for c in cpus), default=0)
+    return {
+        "cpu": "all",
+        "samples": sum(c["samples"] for c in cpus),
+        "missed": sum(c["missed"] for c in cpus),
+        "sum_ns": sum(c["sum_ns"] for c in cpus),
+        "max_ns": max((c["max_ns"] for c in cpus), default=0),
+        "hist": [sum(c["hist"][b] for c in cpus if b < len(c["hist"])) for b in range(nbuckets)],
+    }
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    ap.add_argument("--path", default=DEFAULT_PATH, help="debugfs histogram file")
+    ap.add_argument("--json", action="store_true", help="print JSON instead of a table")
+    ap.add_argument("--reset", action="store_true", help="reset the histograms after reading")
+    args = ap.parse_args()
+
+    try:
+        with open(args.path) as f:
+            period_us, cpus = parse(f.read())
+    except OSError as e:
+        sys.exit("%s: %s (is timer_driver loaded with selftest_period_us?)" % (args.path, e.strerror))
+
+    rows = [summarise(c) for c in cpus] + [summarise(merge(cpus))]
+
+    if args.json:
+        print(json.dumps({"period_us": period_us, "cpus": rows}, indent=2))
+    else:
+        print("period %s us, latency = actual - expected expiry (ns)" % period_us)
+        print("%-5s %12s %8s %10s %10s %10s %10s %10s" %
+              ("cpu", "samples", "missed", "mean", "p50<=", "p99<=", "p99.9<=", "max"))
+        for r in rows:
+            print("%-5s %12d %8d %10.0f %10d %10d %10d %10d" %
+                  (r["cpu"], r["samples"], r["missed"], r["mean_ns"],
+                   r["p50_ns"], r["p99_ns"], r["p999_ns"], r["max_ns"]))
+
+    if args.reset:
+        with open(args.path, "w") as f:
+            f.write("0\n")
+
+
+if __name__ == "__main__":
+    main()
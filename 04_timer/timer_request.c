@@ -2,40 +2,382 @@
 #include <linux/kernel.h>
 #include <linux/interrupt.h>
 #include <linux/init.h>
+#include <linux/percpu.h>
+#include <linux/ktime.h>
+#include <linux/sched.h>
+#include <linux/kobject.h>
+#include <linux/sysfs.h>
+#include <linux/hrtimer.h>
+#include <linux/smp.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+
+#include "vdrv_irqstat.h"
+#include "vdrv_latbuckets.h"
 
 #define DRIVER_NAME "timer_driver"
-#define TIMER_IRQ 0   
+#define TIMER_IRQ 0
+#define TIMER_EVQ_SIZE 256  // events per CPU, must be a power of two
+#define TIMER_EVQ_MASK (TIMER_EVQ_SIZE - 1)
+
+static struct vdrv_irqstat timer_irqstat; // per-CPU, folded on read
+
+static unsigned int budget = 64;
+module_param(budget, uint, 0644);
+MODULE_PARM_DESC(budget, "Events the IRQ thread handles before yielding the CPU (default: 64)");
+
+static unsigned int selftest_period_us;
+module_param(selftest_period_us, uint, 0444);
+MODULE_PARM_DESC(selftest_period_us, "Measure hrtimer jitter at this period instead of taking the IRQ, 0 = off (default: 0)");
+
+#define VDRV_TRACE_SYSTEM timer_driver
+#define CREATE_TRACE_POINTS
+#include "vdrv_trace.h"
+
+/*
+ * The hard handler only timestamps the interrupt into its CPU's queue and
+ * wakes the IRQ thread. Each queue has one producer (the handler on that
+ * CPU) and one consumer (the thread), so neither side takes a lock.
+ */
+struct timer_evq {
+    u64 ts[TIMER_EVQ_SIZE];
+    unsigned int head;      // written by the hard handler
+    unsigned int tail;      // written by the IRQ thread
+    u64 dropped;            // queue full, event lost
+    u64 max_handler_ns;     // longest hard handler run on this CPU
+};
+
+static DEFINE_PER_CPU(struct timer_evq, timer_evq);
 
-static int irq_counter = 0;
+// Bottom-half counters, only written by the IRQ thread
+static u64 stat_events, stat_batches, stat_max_batch, stat_max_latency_ns;
+static unsigned int timer_drain_cpu;    // where the next batch starts scanning
 
+static struct kobject *timer_kobj;
+
+/*
+ * Self-test: one hard hrtimer pinned to every CPU, fired in hard IRQ
+ * context. Each expiry records how late it ran against the time it was
+ * armed for into a log2 histogram, bucketed as in vdrv_latbuckets.h.
+ */
+struct timer_selftest {
+    struct hrtimer timer;
+    ktime_t period;
+    u64 samples;
+    u64 missed;             // whole periods skipped because an expiry ran too late
+    u64 sum_ns;
+    u64 max_ns;
+    u64 hist[VDRV_LAT_BUCKETS];
+};
+
+static DEFINE_PER_CPU(struct timer_selftest, timer_selftest);
+static struct dentry *timer_dbg_dir;
 
 static irqreturn_t timer_isr(int irq, void *dev_id)
 {
-    irq_counter++;
-    printk(KERN_INFO "[%s] Timer interrupt #%d\n", DRIVER_NAME, irq_counter);
+    struct timer_evq *q = this_cpu_ptr(&timer_evq);
+    u64 t0 = ktime_get_ns();
+    unsigned int head = q->head;
+
+    vdrv_irqstat_hit(&timer_irqstat, t0);
+
+    if (head - smp_load_acquire(&q->tail) < TIMER_EVQ_SIZE) {
+        q->ts[head & TIMER_EVQ_MASK] = t0;
+        smp_store_release(&q->head, head + 1);
+    } else {
+        q->dropped++;
+    }
+
+    q->max_handler_ns = max(q->max_handler_ns, ktime_get_ns() - t0);
+    return IRQ_WAKE_THREAD;
+}
+
+// Drain up to @quota events from one CPU's queue; returns how many
+static unsigned int timer_evq_drain(struct timer_evq *q, int irq, unsigned int quota)
+{
+    unsigned int tail = q->tail;
+    unsigned int head = smp_load_acquire(&q->head);
+    unsigned int n = min(head - tail, quota);
+    u64 now = ktime_get_ns();
+    unsigned int i;
+
+    for (i = 0; i < n; i++) {
+        u64 lat = now - q->ts[(tail + i) & TIMER_EVQ_MASK];
+
+        if (lat > stat_max_latency_ns)
+            WRITE_ONCE(stat_max_latency_ns, lat);
+        trace_vdrv_irq(DRIVER_NAME, irq, stat_events + i + 1);
+    }
+    smp_store_release(&q->tail, tail + n); // slots are free for the handler again
+    WRITE_ONCE(stat_events, stat_events + n);
+    return n;
+}
+
+/*
+ * Process queued events in batches of at most @budget, yielding between
+ * batches like a NAPI poll loop, until every CPU's queue is empty. Each
+ * batch resumes the scan after the last CPU the previous one served, so a
+ * storm on one CPU cannot keep the others' queues from being drained.
+ */
+static irqreturn_t timer_thread_fn(int irq, void *dev_id)
+{
+    unsigned int quota = max(READ_ONCE(budget), 1U);
+    unsigned int done, i, cpu;
+
+    do {
+        done = 0;
+        cpu = timer_drain_cpu;
+        for (i = 0; i < nr_cpu_ids && done < quota; i++) {
+            if (cpu_possible(cpu))
+                done += timer_evq_drain(per_cpu_ptr(&timer_evq, cpu), irq, quota - done);
+            cpu = cpu + 1 < nr_cpu_ids ? cpu + 1 : 0;
+        }
+        timer_drain_cpu = cpu;
+
+        if (done) {
+            WRITE_ONCE(stat_batches, stat_batches + 1);
+            if (done > stat_max_batch)
+                WRITE_ONCE(stat_max_batch, done);
+        }
+        if (done == quota)
+            cond_resched();
+    } while (done == quota);
+
     return IRQ_HANDLED;
 }
 
+static enum hrtimer_restart timer_selftest_fn(struct hrtimer *timer)
+{
+    struct timer_selftest *st = container_of(timer, struct timer_selftest, timer);
+    ktime_t now = ktime_get();
+    s64 late = ktime_to_ns(ktime_sub(now, hrtimer_get_expires(timer)));
+    u64 ns = late > 0 ? late : 0;
+    u64 overruns;
+
+    // only this CPU writes its slot, the debugfs reader tolerates torn snapshots
+    st->samples++;
+    st->sum_ns += ns;
+    st->max_ns = max(st->max_ns, ns);
+    st->hist[vdrv_lat_bucket(ns)]++;
+
+    overruns = hrtimer_forward(timer, now, st->period);
+    if (overruns > 1)
+        st->missed += overruns - 1;
+    return HRTIMER_RESTART;
+}
+
+// runs on every CPU via IPI, so each timer is armed and pinned on its own CPU
+static void timer_selftest_start(void *unused)
+{
+    struct timer_selftest *st = this_cpu_ptr(&timer_selftest);
+
+    hrtimer_start(&st->timer, ktime_add(ktime_get(), st->period), HRTIMER_MODE_ABS_PINNED_HARD);
+}
+
+// debugfs: one row per CPU for jitter_report.py, any write resets the counters
+static int timer_jitter_seq_show(struct seq_file *m, void *v)
+{
+    unsigned int bucket;
+    int cpu;
+
+    seq_printf(m, "# period_us %u\n", selftest_period_us);
+    seq_puts(m, "# cpu samples missed sum_ns max_ns " VDRV_LAT_LEGEND "\n");
+    for_each_online_cpu(cpu) {
+        struct timer_selftest *st = per_cpu_ptr(&timer_selftest, cpu);
+
+        seq_printf(m, "%d %llu %llu %llu %llu", cpu, READ_ONCE(st->samples),
+                   READ_ONCE(st->missed), READ_ONCE(st->sum_ns), READ_ONCE(st->max_ns));
+        for (bucket = 0; bucket < VDRV_LAT_BUCKETS; bucket++)
+            seq_printf(m, " %llu", READ_ONCE(st->hist[bucket]));
+        seq_putc(m, '\n');
+    }
+    return 0;
+}
+
+static int timer_jitter_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, timer_jitter_seq_show, NULL);
+}
+
+static void timer_jitter_reset(void *unused)
+{
+    struct timer_selftest *st = this_cpu_ptr(&timer_selftest);
+
+    // on the owning CPU with interrupts off, so no expiry races the reset
+    st->samples = 0;
+    st->missed = 0;
+    st->sum_ns = 0;
+    st->max_ns = 0;
+    memset(st->hist, 0, sizeof(st->hist));
+}
+
+static ssize_t timer_jitter_write(struct file *file, const char __user *buf,
+                                  size_t count, loff_t *ppos)
+{
+    on_each_cpu(timer_jitter_reset, NULL, 1);
+    return count;
+}
+
+static const struct file_operations timer_jitter_fops = {
+    .owner   = THIS_MODULE,
+    .open    = timer_jitter_open,
+    .read    = seq_read,
+    .write   = timer_jitter_write,
+    .llseek  = seq_lseek,
+    .release = single_release,
+};
+
+static void timer_selftest_stop(void)
+{
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+        hrtimer_cancel(&per_cpu_ptr(&timer_selftest, cpu)->timer);
+}
+
+static void timer_selftest_init(void)
+{
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        struct timer_selftest *st = per_cpu_ptr(&timer_selftest, cpu);
+
+        hrtimer_init(&st->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS_PINNED_HARD);
+        st->timer.function = timer_selftest_fn;
+        st->period = us_to_ktime(selftest_period_us);
+    }
+
+    timer_dbg_dir = debugfs_create_dir(DRIVER_NAME, NULL);
+    debugfs_create_file("jitter_hist", 0600, timer_dbg_dir, NULL, &timer_jitter_fops);
+
+    on_each_cpu(timer_selftest_start, NULL, 1);
+}
+
+// sysfs: /sys/kernel/timer_driver, per-CPU values are folded on read
+static ssize_t events_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%llu\n", READ_ONCE(stat_events));
+}
+
+static ssize_t batches_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%llu\n", READ_ONCE(stat_batches));
+}
+
+static ssize_t max_batch_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%llu\n", READ_ONCE(stat_max_batch));
+}
+
+static ssize_t max_latency_ns_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%llu\n", READ_ONCE(stat_max_latency_ns));
+}
+
+static ssize_t max_handler_ns_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    u64 ns = 0;
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+        ns = max(ns, READ_ONCE(per_cpu_ptr(&timer_evq, cpu)->max_handler_ns));
+    return sprintf(buf, "%llu\n", ns);
+}
+
+static ssize_t dropped_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    u64 sum = 0;
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+        sum += READ_ONCE(per_cpu_ptr(&timer_evq, cpu)->dropped);
+    return sprintf(buf, "%llu\n", sum);
+}
+
+// interrupts taken per CPU and their rates, see vdrv_irqstat.h
+static ssize_t irq_stats_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return vdrv_irqstat_format(&timer_irqstat, buf);
+}
+
+static struct kobj_attribute events_attr = __ATTR_RO(events);
+static struct kobj_attribute batches_attr = __ATTR_RO(batches);
+static struct kobj_attribute max_batch_attr = __ATTR_RO(max_batch);
+static struct kobj_attribute max_latency_ns_attr = __ATTR_RO(max_latency_ns);
+static struct kobj_attribute max_handler_ns_attr = __ATTR_RO(max_handler_ns);
+static struct kobj_attribute dropped_attr = __ATTR_RO(dropped);
+static struct kobj_attribute irq_stats_attr = __ATTR_RO(irq_stats);
+
+static struct attribute *timer_attrs[] = {
+    &events_attr.attr,
+    &batches_attr.attr,
+    &max_batch_attr.attr,
+    &max_latency_ns_attr.attr,
+    &max_handler_ns_attr.attr,
+    &dropped_attr.attr,
+    &irq_stats_attr.attr,
+    NULL,
+};
+
+static const struct attribute_group timer_attr_group = {
+    .attrs = timer_attrs,
+};
+
 static int __init timer_driver_init(void)
 {
     int ret;
 
     printk(KERN_INFO "[%s] Initializing timer driver\n", DRIVER_NAME);
 
-    ret = request_irq(TIMER_IRQ, timer_isr, IRQF_SHARED, DRIVER_NAME, (void *)timer_driver_init);  // this is the number of the int req , the funciton , the flag to check if it is shared or not , driver name and the pointer to identify device
+    ret = vdrv_irqstat_init(&timer_irqstat);
+    if (ret)
+        return ret;
+
+    timer_kobj = kobject_create_and_add(DRIVER_NAME, kernel_kobj);
+    if (!timer_kobj) {
+        ret = -ENOMEM;
+        goto err_irqstat;
+    }
+    ret = sysfs_create_group(timer_kobj, &timer_attr_group);
+    if (ret)
+        goto err_kobj;
+
+    if (selftest_period_us) {
+        // software only: no IRQ line is taken in self-test mode
+        timer_selftest_init();
+        printk(KERN_INFO "[%s] Jitter self-test running, period %u us\n", DRIVER_NAME, selftest_period_us);
+        return 0;
+    }
+
+    // hard handler timestamps, the IRQ thread does the rest
+    ret = request_threaded_irq(TIMER_IRQ, timer_isr, timer_thread_fn, IRQF_SHARED, DRIVER_NAME, (void *)timer_driver_init);
     if (ret) {
         printk(KERN_ERR "[%s] Failed to register IRQ %d\n", DRIVER_NAME, TIMER_IRQ);
-        return ret;
+        goto err_kobj;
     }
 
     printk(KERN_INFO "[%s] IRQ %d registered successfully\n", DRIVER_NAME, TIMER_IRQ);
     return 0;
+
+err_kobj:
+    kobject_put(timer_kobj);
+err_irqstat:
+    vdrv_irqstat_free(&timer_irqstat);
+    return ret;
 }
 
 static void __exit timer_driver_exit(void)
 {
-    free_irq(TIMER_IRQ, (void *)timer_driver_init);
-    printk(KERN_INFO "[%s] Timer driver removed. Total interrupts: %d\n", DRIVER_NAME, irq_counter);
+    if (selftest_period_us) {
+        timer_selftest_stop();
+        debugfs_remove_recursive(timer_dbg_dir);
+    } else {
+        free_irq(TIMER_IRQ, (void *)timer_driver_init);
+    }
+    kobject_put(timer_kobj);
+    printk(KERN_INFO "[%s] Timer driver removed. Total interrupts: %llu\n", DRIVER_NAME,
+           vdrv_irqstat_total(&timer_irqstat));
+    vdrv_irqstat_free(&timer_irqstat);
 }
 
 module_init(timer_driver_init);
@@ -43,4 +385,4 @@ module_exit(timer_driver_exit);
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Embedded Dev");
-MODULE_DESCRIPTION("Embedded Linux Timer Interrupt Driver");
\ No newline at end of file
+MODULE_DESCRIPTION("Embedded Linux Timer Interrupt Driver");
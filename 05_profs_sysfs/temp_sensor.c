@@ -6,41 +6,182 @@
 #include <linux/kobject.h>
 #include <linux/sysfs.h>
 #include <linux/jiffies.h>
+#include <linux/ktime.h>
+#include <linux/seqlock.h>
+#include <linux/bitops.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+
+#include "vdrv_stats.h"
 
 #define DRIVER_NAME "temp_monitor"
 #define PROC_NAME   "temp_monitor"
 
-static int current_temp = 40;     /* Celsius */
+#define TEMP_STATS_BIN_WIDTH 2    /* Celsius per quantile sketch bin, covers 0-127 */
+#define TEMP_MAX_CHANNELS 256
+#define TEMP_HISTORY 16           /* samples kept per channel, must be a power of two */
+
 static int threshold = 70;        /* Celsius */
 
+static unsigned int nr_channels = 1;
+module_param(nr_channels, uint, 0444);
+MODULE_PARM_DESC(nr_channels, "Number of sensor channels (default: 1)");
+
 static struct proc_dir_entry *proc_entry; //procfs pointer
 static struct kobject *temp_kobj; //sysfs kobject
 
+static unsigned int stats_window_ms = 60000;
+module_param(stats_window_ms, uint, 0444);
+MODULE_PARM_DESC(stats_window_ms, "Statistics window length in ms, changeable in sysfs (default: 60000)");
+
+static unsigned int max_age_ms = 100;
+module_param(max_age_ms, uint, 0644);
+MODULE_PARM_DESC(max_age_ms, "Serve a cached reading up to this old before sampling the sensor again (default: 100)");
+
+// every sensor sample, from any channel, feeds the statistics
+static struct vdrv_stats temp_stats;
+
+/*
+ * Sampling cache, one per channel: readers copy the reading and its
+ * timestamp under the channel's seqlock without taking any lock. When the
+ * reading is older than max_age_ms, the one reader that wins
+ * TEMP_REFRESHING samples the sensor and publishes the result, appending
+ * it to the channel's history; everyone else keeps serving the old value
+ * meanwhile instead of piling onto the sensor. Before the first sample
+ * there is no old value, so losers read the sensor themselves.
+ */
+#define TEMP_REFRESHING 0
+
+struct temp_sample {
+    u64 stamp_ns;
+    int temp;                     /* Celsius */
+};
 
-static int read_temperature(void)
+struct temp_channel {
+    seqlock_t lock;
+    struct temp_sample cur;       /* cached reading, stamp_ns 0 = never sampled */
+    unsigned long flags;
+    unsigned int hist_head;       /* samples ever recorded */
+    struct temp_sample hist[TEMP_HISTORY];
+};
+
+static struct temp_channel *channels;
+
+/*
+ * Binary sysfs "channels": one packed record per channel, in channel
+ * order, little to parse for machine consumers.
+ */
+struct temp_channel_rec {
+    u32 channel;
+    s32 temp;                     /* Celsius */
+    u64 stamp_ns;                 /* CLOCK_MONOTONIC of the sample */
+} __packed;
+
+static int sample_sensor(unsigned int ch)
 {
-    current_temp = 60 + (jiffies % 40);  // 60 -100
-    return current_temp;
+    return 60 + ((jiffies + ch * 7) % 40);  // 60 -100
 }
 
+static struct temp_sample read_channel(unsigned int ch)
+{
+    struct temp_channel *c = &channels[ch];
+    u64 now = ktime_get_ns();
+    struct temp_sample s;
+    unsigned int seq;
+
+    do {
+        seq = read_seqbegin(&c->lock);
+        s = c->cur;
+    } while (read_seqretry(&c->lock, seq));
+
+    if (s.stamp_ns && now - s.stamp_ns < (u64)READ_ONCE(max_age_ms) * NSEC_PER_MSEC)
+        return s;
+
+    if (test_and_set_bit_lock(TEMP_REFRESHING, &c->flags)) {
+        if (s.stamp_ns)
+            return s; // someone else is refreshing, the cached value will do
+
+        // nothing cached yet: sample for ourselves, the refresher publishes
+        s.temp = sample_sensor(ch);
+        s.stamp_ns = now;
+        vdrv_stats_add(&temp_stats, s.temp, now);
+        return s;
+    }
+
+    s.temp = sample_sensor(ch);
+    s.stamp_ns = now;
+
+    write_seqlock(&c->lock);
+    c->cur = s;
+    c->hist[c->hist_head++ & (TEMP_HISTORY - 1)] = s;
+    write_sequnlock(&c->lock);
+
+    clear_bit_unlock(TEMP_REFRESHING, &c->flags);
+
+    vdrv_stats_add(&temp_stats, s.temp, now);
+    return s;
+}
 
-static ssize_t proc_read(struct file *file, char __user *buf,
-                         size_t count, loff_t *ppos)
+static int read_temperature(void)
 {
-    char buffer[128];
-    int len;
+    return read_channel(0).temp;
+}
 
-    read_temperature(); // the function is called 
+/*
+ * /proc/temp_monitor: the threshold, then one line per channel with its
+ * current reading and recent history, oldest first, streamed via seq_file.
+ */
+static void *temp_seq_start(struct seq_file *m, loff_t *pos)
+{
+    if (*pos == 0)
+        return SEQ_START_TOKEN;
+    return *pos <= nr_channels ? &channels[*pos - 1] : NULL;
+}
 
-    len = snprintf(buffer, sizeof(buffer),
-                   "Temperature: %d C\nThreshold: %d C\n",
-                   current_temp, threshold); // the data is stored in the buffer
+static void *temp_seq_next(struct seq_file *m, void *v, loff_t *pos)
+{
+    ++*pos;
+    return temp_seq_start(m, pos);
+}
 
-    return simple_read_from_buffer(buf, count, ppos, buffer, len); // the data read from buffer to buf userspace and ppos represent the cursor movement
+static void temp_seq_stop(struct seq_file *m, void *v)
+{
 }
 
-static const struct proc_ops proc_fops = {
-    .proc_read = proc_read,
+static int temp_seq_show(struct seq_file *m, void *v)
+{
+    struct temp_channel *c = v;
+    struct temp_sample hist[TEMP_HISTORY];
+    struct temp_sample cur;
+    unsigned int ch, head, n, i, seq;
+
+    if (v == SEQ_START_TOKEN) {
+        seq_printf(m, "Threshold: %d C\n", threshold);
+        return 0;
+    }
+
+    ch = c - channels;
+    cur = read_channel(ch);
+
+    do {
+        seq = read_seqbegin(&c->lock);
+        head = c->hist_head;
+        memcpy(hist, c->hist, sizeof(hist));
+    } while (read_seqretry(&c->lock, seq));
+
+    n = min_t(unsigned int, head, TEMP_HISTORY);
+    seq_printf(m, "Channel %u: %d C history:", ch, cur.temp);
+    for (i = head - n; i != head; i++)
+        seq_printf(m, " %d", hist[i & (TEMP_HISTORY - 1)].temp);
+    seq_putc(m, '\n');
+    return 0;
+}
+
+static const struct seq_operations temp_seq_ops = {
+    .start = temp_seq_start,
+    .next  = temp_seq_next,
+    .stop  = temp_seq_stop,
+    .show  = temp_seq_show,
 };
 
 // read function for sysfs
@@ -51,12 +192,12 @@ static const struct proc_ops proc_fops = {
 // snprintf -stored in buff as string and written the int value 
 
 // attr  - creates sysf
+// channel 0, as before channels existed
 static ssize_t temperature_show(struct kobject *kobj,
                                 struct kobj_attribute *attr,
                                 char *buf)
 {
-    read_temperature();
-    return sprintf(buf, "%d\n", current_temp);
+    return sprintf(buf, "%d\n", read_temperature());
 }
 
 static struct kobj_attribute temperature_attr =
@@ -91,25 +232,110 @@ static ssize_t threshold_store(struct kobject *kobj,
 static struct kobj_attribute threshold_attr =
     __ATTR(threshold, 0664, threshold_show, threshold_store);
 
+// statistics over the last complete window, computed in O(1) on read
+static ssize_t stats_show(struct kobject *kobj,
+                          struct kobj_attribute *attr,
+                          char *buf)
+{
+    struct vdrv_stats_summary sum;
+
+    vdrv_stats_read(&temp_stats, ktime_get_ns(), &sum);
+    return vdrv_stats_format(&sum, buf);
+}
+
+static struct kobj_attribute stats_attr =
+    __ATTR(stats, 0444, stats_show, NULL);
+
+static ssize_t stats_window_ms_show(struct kobject *kobj,
+                                    struct kobj_attribute *attr,
+                                    char *buf)
+{
+    return sprintf(buf, "%u\n", READ_ONCE(stats_window_ms));
+}
+
+static ssize_t stats_window_ms_store(struct kobject *kobj,
+                                     struct kobj_attribute *attr,
+                                     const char *buf, size_t count)
+{
+    unsigned int value;
+
+    if (kstrtouint(buf, 10, &value) || !value)
+        return -EINVAL;
+
+    WRITE_ONCE(stats_window_ms, value);
+    vdrv_stats_set_window(&temp_stats, (u64)value * NSEC_PER_MSEC); // starts a fresh window
+
+    return count;
+}
+
+static struct kobj_attribute stats_window_ms_attr =
+    __ATTR(stats_window_ms, 0664, stats_window_ms_show, stats_window_ms_store);
+
+// binary: struct temp_channel_rec per channel, any offset/length
+static ssize_t channels_read(struct file *filp, struct kobject *kobj,
+                             struct bin_attribute *attr, char *buf,
+                             loff_t off, size_t count)
+{
+    size_t done = 0;
+
+    while (done < count && off + done < attr->size) {
+        unsigned int ch = (off + done) / sizeof(struct temp_channel_rec);
+        size_t skip = (off + done) % sizeof(struct temp_channel_rec);
+        size_t len = min(sizeof(struct temp_channel_rec) - skip, count - done);
+        struct temp_sample s = read_channel(ch);
+        struct temp_channel_rec rec = {
+            .channel  = ch,
+            .temp     = s.temp,
+            .stamp_ns = s.stamp_ns,
+        };
+
+        memcpy(buf + done, (char *)&rec + skip, len);
+        done += len;
+    }
+    return done;
+}
+
+static struct bin_attribute channels_attr =
+    __BIN_ATTR(channels, 0444, channels_read, NULL, 0);
 
 static int __init temp_driver_init(void)
 {
+    unsigned int i;
     int ret;
 
     pr_info("%s: Initializing temperature driver\n", DRIVER_NAME);
 
+    if (!stats_window_ms || !nr_channels || nr_channels > TEMP_MAX_CHANNELS)
+        return -EINVAL;
+    vdrv_stats_init(&temp_stats, 0, TEMP_STATS_BIN_WIDTH, (u64)stats_window_ms * NSEC_PER_MSEC);
+
+    channels = kcalloc(nr_channels, sizeof(*channels), GFP_KERNEL);
+    if (!channels)
+        return -ENOMEM;
+    for (i = 0; i < nr_channels; i++)
+        seqlock_init(&channels[i].lock);
+
     /* Procfs */
-    proc_entry = proc_create(PROC_NAME, 0444, NULL, &proc_fops); // read operation
-    if (!proc_entry)
+    proc_entry = proc_create_seq(PROC_NAME, 0444, NULL, &temp_seq_ops); // all channels, one read
+    if (!proc_entry) {
+        kfree(channels);
         return -ENOMEM;
+    }
 
     /* Sysfs */
     temp_kobj = kobject_create_and_add(DRIVER_NAME, kernel_kobj);
-    if (!temp_kobj)
+    if (!temp_kobj) {
+        proc_remove(proc_entry);
+        kfree(channels);
         return -ENOMEM;
+    }
 
     ret = sysfs_create_file(temp_kobj, &temperature_attr.attr); //read only in sysfs
     ret |= sysfs_create_file(temp_kobj, &threshold_attr.attr); //read and write in sysfs
+    ret |= sysfs_create_file(temp_kobj, &stats_attr.attr);
+    ret |= sysfs_create_file(temp_kobj, &stats_window_ms_attr.attr);
+    channels_attr.size = nr_channels * sizeof(struct temp_channel_rec);
+    ret |= sysfs_create_bin_file(temp_kobj, &channels_attr); //packed array of all channels
     if (ret)
         pr_err("%s: Failed to create sysfs files\n", DRIVER_NAME);
 
@@ -121,7 +347,11 @@ static void __exit temp_driver_exit(void)
     proc_remove(proc_entry);
     sysfs_remove_file(temp_kobj, &temperature_attr.attr);
     sysfs_remove_file(temp_kobj, &threshold_attr.attr);
+    sysfs_remove_file(temp_kobj, &stats_attr.attr);
+    sysfs_remove_file(temp_kobj, &stats_window_ms_attr.attr);
+    sysfs_remove_bin_file(temp_kobj, &channels_attr);
     kobject_put(temp_kobj);
+    kfree(channels);
 
     pr_info("%s: Driver unloaded\n", DRIVER_NAME);
 }
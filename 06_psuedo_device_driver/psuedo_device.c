@@ -7,64 +7,336 @@
 #include <linux/ioctl.h>
 #include <linux/random.h>
 #include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/kobject.h>
+#include <linux/sysfs.h>
+#include <linux/atomic.h>
+
+#include "vhrm.h"
+#include "vdrv_stats.h"
+#include "vdrv_wake.h"
+
+#define VDRV_TRACE_SYSTEM vhrm
+#define CREATE_TRACE_POINTS
+#include "vdrv_trace.h"
 
 #define DEVICE_NAME "vhrm"
-#define MAJOR_NUM 241
 
-// IOCTL commands
-#define IOCTL_SET_SAMPLING_RATE _IOW(MAJOR_NUM, 0, int)
+#define HRM_MAX_RATE 10000      // Hz
+#define HRM_RING_SIZE 4096      // samples, must be a power of two
+#define HRM_RING_MASK (HRM_RING_SIZE - 1)
+#define HRM_MAX_GROUP (HRM_RING_SIZE / 4)   // a group must fit the ring comfortably
+#define HRM_READ_BATCH 64                   // records built per copy_to_user
+#define HRM_STATS_BIN_WIDTH 4               // bpm per quantile sketch bin, covers 0-255
+
+static int hrm_major = VHRM_MAJOR;
+
+static unsigned int source_rate = 1000;
+module_param(source_rate, uint, 0444);
+MODULE_PARM_DESC(source_rate, "Rate of the shared sampler in Hz, the most a reader can ask for (default: 1000)");
+
+static unsigned int low_watermark = 1;
+module_param(low_watermark, uint, 0644);
+MODULE_PARM_DESC(low_watermark, "New samples before a reader is woken, per-file override via IOCTL_SET_LOWAT (default: 1)");
+
+static unsigned int stats_window_ms = 10000;
+module_param(stats_window_ms, uint, 0444);
+MODULE_PARM_DESC(stats_window_ms, "Statistics window length in ms, changeable in sysfs (default: 10000)");
+
+/*
+ * Sampler: an hrtimer fills the ring at source_rate and publishes each
+ * sample by advancing hrm_head. Reads never sleep for the sampler; they
+ * return the oldest records this file has not seen yet. The slot at
+ * hrm_head is rewritten before hrm_head moves, so a file more than
+ * HRM_RING_SIZE - 1 samples behind loses the oldest ones.
+ *
+ * The sampler never changes rate. Each file subscribes at its own rate by
+ * reducing groups of source samples to one record, picking the last
+ * sample or averaging the group as its filter says. Group sizes come from
+ * a phase accumulator, so rates that do not divide source_rate mix
+ * floor and ceiling sized groups and still average out exactly.
+ */
+static struct hrtimer hrm_timer;
+static struct vhrm_record *hrm_ring;
+static u64 hrm_head;                    // index of the next sample
+static bool hrm_late;                   // last tick overran, flag the next record
+static struct vdrv_wake hrm_wake = VDRV_WAKE_INIT(hrm_wake); // blocked readers, see vdrv_wake.h
+
+// Rate accounting, shown under /sys/kernel/vhrm
+static atomic64_t hrm_dropped = ATOMIC64_INIT(0);   // samples readers lost to overrun
+static atomic64_t hrm_missed = ATOMIC64_INIT(0);    // timer periods that produced no sample
+static u64 hrm_win_start_ns, hrm_win_head;
+static unsigned int hrm_achieved_mhz;               // samples/sec * 1000 over the last window
+static struct kobject *hrm_kobj;
+
+// Streaming statistics of the source, over stats_window_ms tumbling windows
+static struct vdrv_stats hrm_stats;
+
+// Per-open-file state; configuration is set by ioctl and read locklessly
+struct hrm_reader {
+    struct mutex lock;      // only threads sharing this file contend here
+    u64 cursor;             // index of the next source sample this file consumes
+    u64 rec_seq;            // index of the next record this file returns
+    unsigned int lowat;     // records pending before a blocked read or poll wakes
+    unsigned int rate;      // records per second, at most source_rate
+    unsigned int phase;     // accumulator remainder, below rate
+    unsigned int filter;    // VHRM_FILTER_*
+    struct vhrm_record batch[HRM_READ_BATCH];
+};
+
+static enum hrtimer_restart hrm_sample_fn(struct hrtimer *timer) {
+    u64 head = hrm_head;
+    struct vhrm_record *s = &hrm_ring[head & HRM_RING_MASK];
+    u64 now = ktime_get_ns();
+    u64 overruns;
+    int hr_value;
+
+    // Simulate heart rate: random number 60-100 bpm
+    get_random_bytes(&hr_value, sizeof(hr_value));
+
+    smp_wmb(); // readers that see this slot change must also see the old head
+    s->timestamp_ns = now;
+    s->seq = head;
+    s->bpm = 60 + (unsigned int)hr_value % 41; // 60-100
+    s->flags = hrm_late ? VHRM_REC_LATE : 0;
+    smp_store_release(&hrm_head, head + 1);
+
+    vdrv_stats_add(&hrm_stats, s->bpm, now);
+
+    // achieved rate over roughly one-second windows
+    if (now - hrm_win_start_ns >= NSEC_PER_SEC) {
+        WRITE_ONCE(hrm_achieved_mhz,
+                   div64_u64((head + 1 - hrm_win_head) * NSEC_PER_SEC * 1000ULL, now - hrm_win_start_ns));
+        hrm_win_start_ns = now;
+        hrm_win_head = head + 1;
+    }
+
+    // only wake the queue once the nearest low-water mark is reached
+    vdrv_wake_publish(&hrm_wake, head + 1);
 
-static int hrm_major = MAJOR_NUM;
-static int sampling_rate = 1; // default 1Hz
-static DEFINE_MUTEX(hrm_mutex); // protect shared data
+    overruns = hrtimer_forward_now(timer, ns_to_ktime(NSEC_PER_SEC / source_rate));
+    hrm_late = overruns > 1;
+    if (hrm_late)
+        atomic64_add(overruns - 1, &hrm_missed);
+    return HRTIMER_RESTART;
+}
+
+// True once @rd has @need unread samples; registers its target with the sampler first
+static bool hrm_ready(struct hrm_reader *rd, u64 need) {
+    return vdrv_wake_ready(&hrm_wake, &hrm_head, READ_ONCE(rd->cursor), need);
+}
 
 // Device open
 static int hrm_open(struct inode *inode, struct file *file) {
-    printk(KERN_INFO "vhrm: device opened\n");
+    struct hrm_reader *rd = kzalloc(sizeof(*rd), GFP_KERNEL);
+
+    if (!rd)
+        return -ENOMEM;
+    mutex_init(&rd->lock);
+    rd->cursor = smp_load_acquire(&hrm_head);
+    rd->lowat = clamp_t(unsigned int, READ_ONCE(low_watermark), 1, HRM_RING_MASK);
+    rd->rate = source_rate;
+    rd->filter = VHRM_FILTER_NONE;
+    file->private_data = rd;
+
+    trace_vdrv_open(DEVICE_NAME, file);
     return 0;
 }
 
 // Device close
 static int hrm_release(struct inode *inode, struct file *file) {
-    printk(KERN_INFO "vhrm: device closed\n");
+    trace_vdrv_release(DEVICE_NAME, file);
+    kfree(file->private_data);
     return 0;
 }
 
-// Device read
-static ssize_t hrm_read(struct file *file, char __user *buf, size_t len, loff_t *offset) {
-    int hr_value;
+// Source samples the next @records records of @rd consume
+static u64 hrm_group_samples(struct hrm_reader *rd, u64 records) {
+    unsigned int rate = READ_ONCE(rd->rate);
 
-    // Simulate heart rate: random number 60-100 bpm
-    get_random_bytes(&hr_value, sizeof(hr_value));
-    hr_value = 60 + (hr_value % 41); // 60-100
+    return div_u64(READ_ONCE(rd->phase) + records * source_rate, rate);
+}
+
+/*
+ * Reduce up to @max groups of source samples into rd->batch and advance
+ * the cursor past them. Each record adds source_rate to the phase and
+ * takes phase / rate samples, keeping the remainder. Returns the number
+ * of records built. Called with rd->lock held.
+ */
+static size_t hrm_fill(struct hrm_reader *rd, unsigned int filter, size_t max) {
+    unsigned int rate = rd->rate;
+    u64 head, start, idx, seq;
+    size_t n;
+    unsigned int j, g, phase, sum;
+    u16 flags;
+
+retry:
+    head = smp_load_acquire(&hrm_head);
+    start = rd->cursor;
+    if (head - start > HRM_RING_MASK) // overrun: skip to the oldest stable sample
+        start = head - HRM_RING_MASK;
+
+    // records lost to an overrun still count, so seq jumps where they were
+    seq = rd->rec_seq + div_u64((start - rd->cursor) * rate, source_rate);
+    phase = rd->phase;
+    for (n = 0, idx = start; n < max; n++) {
+        struct vhrm_record *out = &rd->batch[n];
+
+        g = (phase + source_rate) / rate;
+        if (head - idx < g)
+            break;
+        phase = (phase + source_rate) % rate;
+
+        sum = 0;
+        flags = 0;
+        for (j = 0; j < g; j++, idx++) {
+            const struct vhrm_record *s = &hrm_ring[idx & HRM_RING_MASK];
+
+            sum += s->bpm;
+            flags |= s->flags;
+            if (j == g - 1)
+                *out = *s;
+        }
+        if (filter == VHRM_FILTER_MEAN)
+            out->bpm = DIV_ROUND_CLOSEST(sum, g);
+        out->seq = seq + n;
+        out->flags = flags;
+    }
 
-    if (len < sizeof(int))
+    smp_rmb();
+    if (READ_ONCE(hrm_head) - start > HRM_RING_MASK) // oldest slot reused under us
+        goto retry;
+
+    if (n && start != rd->cursor) {
+        atomic64_add(start - rd->cursor, &hrm_dropped);
+        rd->batch[0].flags |= VHRM_REC_GAP;
+    }
+    if (n) {
+        rd->cursor = idx;
+        rd->rec_seq = seq + n;
+        WRITE_ONCE(rd->phase, phase);
+    }
+    return n;
+}
+
+// Device read: as many unseen records as fit, oldest first
+static ssize_t __hrm_read(struct file *file, char __user *buf, size_t len) {
+    struct hrm_reader *rd = file->private_data;
+    struct vhrm_record __user *urec = (struct vhrm_record __user *)buf;
+    size_t max = len / sizeof(struct vhrm_record);
+    unsigned int filter = READ_ONCE(rd->filter);
+    size_t done = 0, n;
+    ssize_t ret = 0;
+
+    if (!max)
         return -EINVAL;
 
-    if (copy_to_user(buf, &hr_value, sizeof(int)))
-        return -EFAULT;
+    // block until the low-water mark, or a full buffer if that is smaller
+    if (!(file->f_flags & O_NONBLOCK)) {
+        u64 need = min_t(u64, hrm_group_samples(rd, min_t(size_t, READ_ONCE(rd->lowat), max)), HRM_RING_MASK);
+
+        ret = wait_event_interruptible(hrm_wake.wq, hrm_ready(rd, need));
+        if (ret)
+            return ret;
+    }
+
+    mutex_lock(&rd->lock);
+    while (done < max) {
+        n = hrm_fill(rd, filter, min_t(size_t, max - done, HRM_READ_BATCH));
+        if (!n)
+            break;
+        if (copy_to_user(urec + done, rd->batch, n * sizeof(struct vhrm_record))) {
+            ret = -EFAULT;
+            break;
+        }
+        done += n;
+    }
+    mutex_unlock(&rd->lock);
+
+    if (!done)
+        return ret ? ret : -EAGAIN;
+
+    return done * sizeof(struct vhrm_record);
+}
+
+static ssize_t hrm_read(struct file *file, char __user *buf, size_t len, loff_t *offset) {
+    ssize_t ret = __hrm_read(file, buf, len);
+
+    trace_vdrv_read(DEVICE_NAME, len, ret);
+    return ret;
+}
 
-    printk(KERN_INFO "vhrm: heart rate read: %d bpm\n", hr_value);
-    msleep(1000 / sampling_rate); // simulate sampling delay
+static __poll_t hrm_poll(struct file *file, poll_table *wait) {
+    struct hrm_reader *rd = file->private_data;
+    u64 need = min_t(u64, hrm_group_samples(rd, READ_ONCE(rd->lowat)), HRM_RING_MASK);
 
-    return sizeof(int);
+    poll_wait(file, &hrm_wake.wq, wait);
+    return hrm_ready(rd, need) ? EPOLLIN | EPOLLRDNORM : 0;
 }
 
 // IOCTL handler
-static long hrm_ioctl(struct file *file, unsigned int cmd, unsigned long arg) {
+static long __hrm_ioctl(struct file *file, unsigned int cmd, unsigned long arg) {
+    struct hrm_reader *rd = file->private_data;
     int rate; // this is passed from the user ioctl(fd,ioctl_Set_sampleing_rate,&rate)
+    int lowat, filter;
+    u32 version = VHRM_RECORD_VERSION;
+    struct vdrv_stats_summary sum;
+    struct vhrm_stats st;
+
     switch(cmd) {
         case IOCTL_SET_SAMPLING_RATE:
             if (copy_from_user(&rate, (int __user *)arg, sizeof(rate))) //copy data from the user-space
                 return -EFAULT;
-            if (rate <= 0 || rate > 100)
+            // the sampler runs at source_rate, no file can be served faster
+            if (rate <= 0 || rate > source_rate)
+                return -EINVAL;
+            if (DIV_ROUND_UP(source_rate, rate) > HRM_MAX_GROUP)
                 return -EINVAL;
 
-            mutex_lock(&hrm_mutex);
-            sampling_rate = rate; // only one function overwrites the value at a time
-            mutex_unlock(&hrm_mutex);
-
-            printk(KERN_INFO "vhrm: sampling rate set to %d Hz\n", rate);
+            // this file only: decimate the shared source down to exactly @rate
+            mutex_lock(&rd->lock);
+            WRITE_ONCE(rd->rate, rate);
+            WRITE_ONCE(rd->phase, 0);
+            mutex_unlock(&rd->lock);
+            break;
+        case IOCTL_SET_FILTER:
+            if (copy_from_user(&filter, (int __user *)arg, sizeof(filter)))
+                return -EFAULT;
+            if (filter != VHRM_FILTER_NONE && filter != VHRM_FILTER_MEAN)
+                return -EINVAL;
+            WRITE_ONCE(rd->filter, filter);
+            break;
+        case IOCTL_SET_LOWAT:
+            if (copy_from_user(&lowat, (int __user *)arg, sizeof(lowat)))
+                return -EFAULT;
+            if (lowat <= 0 || lowat > HRM_RING_MASK)
+                return -EINVAL;
+            WRITE_ONCE(rd->lowat, lowat);
+            wake_up_interruptible_poll(&hrm_wake.wq, EPOLLIN | EPOLLRDNORM); // let waiters re-check
+            break;
+        case IOCTL_GET_RECORD_VERSION:
+            if (copy_to_user((u32 __user *)arg, &version, sizeof(version)))
+                return -EFAULT;
+            break;
+        case IOCTL_GET_STATS:
+            vdrv_stats_read(&hrm_stats, ktime_get_ns(), &sum);
+            memset(&st, 0, sizeof(st));
+            st.count = sum.count;
+            st.window_ns = sum.window_ns;
+            st.window_end_ns = sum.window_end_ns;
+            st.min = sum.min;
+            st.max = sum.max;
+            st.mean_milli = sum.mean_milli;
+            st.stddev_milli = sum.stddev_milli;
+            st.p50 = sum.p50;
+            st.p90 = sum.p90;
+            st.p99 = sum.p99;
+            if (copy_to_user((struct vhrm_stats __user *)arg, &st, sizeof(st)))
+                return -EFAULT;
             break;
         default:
             return -EINVAL;
@@ -72,29 +344,136 @@ static long hrm_ioctl(struct file *file, unsigned int cmd, unsigned long arg) {
     return 0;
 }
 
+static long hrm_ioctl(struct file *file, unsigned int cmd, unsigned long arg) {
+    long ret = __hrm_ioctl(file, cmd, arg);
+
+    trace_vdrv_ioctl(DEVICE_NAME, cmd, ret);
+    return ret;
+}
+
 // File operations
 static struct file_operations fops = {
     .owner = THIS_MODULE,
     .open = hrm_open,
     .release = hrm_release,
     .read = hrm_read,
+    .poll = hrm_poll,
     .unlocked_ioctl = hrm_ioctl,
 };
 
+// sysfs: requested vs achieved rate and loss counters
+static ssize_t requested_rate_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf) {
+    return sprintf(buf, "%u\n", source_rate);
+}
+
+static ssize_t achieved_rate_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf) {
+    unsigned int mhz = READ_ONCE(hrm_achieved_mhz);
+
+    return sprintf(buf, "%u.%03u\n", mhz / 1000, mhz % 1000);
+}
+
+static ssize_t dropped_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf) {
+    return sprintf(buf, "%lld\n", atomic64_read(&hrm_dropped));
+}
+
+static ssize_t missed_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf) {
+    return sprintf(buf, "%lld\n", atomic64_read(&hrm_missed));
+}
+
+// last complete window: count, min/max, mean, stddev and approximate quantiles
+static ssize_t stats_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf) {
+    struct vdrv_stats_summary sum;
+
+    vdrv_stats_read(&hrm_stats, ktime_get_ns(), &sum);
+    return vdrv_stats_format(&sum, buf);
+}
+
+static ssize_t stats_window_ms_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf) {
+    return sprintf(buf, "%u\n", READ_ONCE(stats_window_ms));
+}
+
+static ssize_t stats_window_ms_store(struct kobject *kobj, struct kobj_attribute *attr,
+                                     const char *buf, size_t count) {
+    unsigned int ms;
+
+    if (kstrtouint(buf, 10, &ms) || !ms)
+        return -EINVAL;
+
+    WRITE_ONCE(stats_window_ms, ms);
+    vdrv_stats_set_window(&hrm_stats, (u64)ms * NSEC_PER_MSEC); // starts a fresh window
+    return count;
+}
+
+static struct kobj_attribute requested_rate_attr = __ATTR_RO(requested_rate);
+static struct kobj_attribute achieved_rate_attr = __ATTR_RO(achieved_rate);
+static struct kobj_attribute dropped_attr = __ATTR_RO(dropped);
+static struct kobj_attribute missed_attr = __ATTR_RO(missed);
+static struct kobj_attribute stats_attr = __ATTR_RO(stats);
+static struct kobj_attribute stats_window_ms_attr = __ATTR_RW(stats_window_ms);
+
+static struct attribute *hrm_attrs[] = {
+    &requested_rate_attr.attr,
+    &achieved_rate_attr.attr,
+    &dropped_attr.attr,
+    &missed_attr.attr,
+    &stats_attr.attr,
+    &stats_window_ms_attr.attr,
+    NULL,
+};
+
+static const struct attribute_group hrm_attr_group = {
+    .attrs = hrm_attrs,
+};
+
 // Module init
 static int __init hrm_init(void) {
-    int result = register_chrdev(hrm_major, DEVICE_NAME, &fops);
+    int result;
+
+    if (!source_rate || source_rate > HRM_MAX_RATE || !stats_window_ms)
+        return -EINVAL;
+
+    vdrv_stats_init(&hrm_stats, 0, HRM_STATS_BIN_WIDTH, (u64)stats_window_ms * NSEC_PER_MSEC);
+
+    hrm_ring = kcalloc(HRM_RING_SIZE, sizeof(*hrm_ring), GFP_KERNEL);
+    if (!hrm_ring)
+        return -ENOMEM;
+
+    hrm_kobj = kobject_create_and_add(DEVICE_NAME, kernel_kobj);
+    if (!hrm_kobj) {
+        result = -ENOMEM;
+        goto err_ring;
+    }
+    result = sysfs_create_group(hrm_kobj, &hrm_attr_group);
+    if (result)
+        goto err_kobj;
+
+    result = register_chrdev(hrm_major, DEVICE_NAME, &fops);
     if (result < 0) {
         printk(KERN_ERR "vhrm: failed to register device\n");
-        return result;
+        goto err_kobj;
     }
+
+    hrm_win_start_ns = ktime_get_ns();
+    hrtimer_init(&hrm_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    hrm_timer.function = hrm_sample_fn;
+    hrtimer_start(&hrm_timer, ns_to_ktime(NSEC_PER_SEC / source_rate), HRTIMER_MODE_REL);
+
     printk(KERN_INFO "vhrm: Virtual Heart Rate Monitor loaded (major %d)\n", hrm_major);
     return 0;
+
+err_kobj:
+    kobject_put(hrm_kobj); // removes the group with it
+err_ring:
+    kfree(hrm_ring);
+    return result;
 }
 
 // Module exit
 static void __exit hrm_exit(void) {
+    hrtimer_cancel(&hrm_timer);
     unregister_chrdev(hrm_major, DEVICE_NAME);
+    kobject_put(hrm_kobj);
+    kfree(hrm_ring);
     printk(KERN_INFO "vhrm: Virtual Heart Rate Monitor unloaded\n");
 }
 
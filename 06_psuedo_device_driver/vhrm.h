@@ -0,0 +1,48 @@
+/* vhrm.h - vhrm interface shared by the driver and user space */
+#ifndef _VHRM_H
+#define _VHRM_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define VHRM_MAJOR 241
+
+// IOCTL commands
+#define IOCTL_SET_SAMPLING_RATE   _IOW(VHRM_MAJOR, 0, int)  // per file, Hz; -EINVAL above source_rate
+#define IOCTL_SET_LOWAT           _IOW(VHRM_MAJOR, 1, int)
+#define IOCTL_GET_RECORD_VERSION  _IOR(VHRM_MAJOR, 2, __u32)
+#define IOCTL_SET_FILTER          _IOW(VHRM_MAJOR, 3, int)
+#define IOCTL_GET_STATS           _IOR(VHRM_MAJOR, 4, struct vhrm_stats)
+
+// how a file reduces each group of source samples to one record
+#define VHRM_FILTER_NONE    0   // last sample of the group
+#define VHRM_FILTER_MEAN    1   // rounded mean of the group
+
+// bumped whenever struct vhrm_record changes
+#define VHRM_RECORD_VERSION 1
+
+// record flags
+#define VHRM_REC_GAP    0x0001  // records before this one were lost to overrun
+#define VHRM_REC_LATE   0x0002  // the sampler missed periods before this record
+
+// read() returns as many of these as fit, packed back to back
+struct vhrm_record {
+    __u64 timestamp_ns;     // CLOCK_MONOTONIC
+    __u32 seq;              // low 32 bits of the record's index in this file's stream
+    __u16 bpm;
+    __u16 flags;            // VHRM_REC_*
+};
+
+// IOCTL_GET_STATS: the last complete stats window of the shared source
+struct vhrm_stats {
+    __u64 count;
+    __u64 window_ns;
+    __u64 window_end_ns;    // CLOCK_MONOTONIC
+    __s32 min, max;         // bpm
+    __s32 mean_milli;       // bpm * 1000
+    __u32 stddev_milli;     // bpm * 1000
+    __s32 p50, p90, p99;    // approximate, bpm
+    __u32 reserved;
+};
+
+#endif /* _VHRM_H */
@@ -18,16 +18,20 @@ static struct class *daq_class;
 static void *dma_virt;
 static dma_addr_t dma_phys;
 
+#define VDRV_TRACE_SYSTEM daq
+#define CREATE_TRACE_POINTS
+#include "vdrv_trace.h"
+
 
 static int daq_open(struct inode *inode, struct file *file)
 {
-    pr_info("%s: device opened\n", DRIVER_NAME);
+    trace_vdrv_open(DEVICE_NAME, file);
     return 0;
 }
 
 static int daq_release(struct inode *inode, struct file *file)
 {
-    pr_info("%s: device closed\n", DRIVER_NAME);
+    trace_vdrv_release(DEVICE_NAME, file);
     return 0;
 }
 
@@ -41,9 +45,12 @@ static int daq_mmap(struct file *file, struct vm_area_struct *vma)
     //vm_flags - permission and behaviour
     //vm_page_proto - cache / page protection
     unsigned long size = vma->vm_end - vma->vm_start;
+    int ret;
 
-    if (size > DMA_BUF_SIZE)
+    if (size > DMA_BUF_SIZE) {
+        trace_vdrv_mmap(DEVICE_NAME, vma->vm_pgoff, size, -EINVAL);
         return -EINVAL;
+    }
 
     vma->vm_flags |= VM_IO | VM_DONTEXPAND | VM_DONTDUMP;
  //mmap - map the physical DMA page to user
@@ -55,11 +62,13 @@ static int daq_mmap(struct file *file, struct vm_area_struct *vma)
  //size - how many bytes to map
  //vma->vm_page_prot - read/write permission
 
-    return remap_pfn_range(vma,
-                           vma->vm_start,
-                           dma_phys >> PAGE_SHIFT,
-                           size,
-                           vma->vm_page_prot);
+    ret = remap_pfn_range(vma,
+                          vma->vm_start,
+                          dma_phys >> PAGE_SHIFT,
+                          size,
+                          vma->vm_page_prot);
+    trace_vdrv_mmap(DEVICE_NAME, vma->vm_pgoff, size, ret);
+    return ret;
 }
 
 static struct file_operations daq_fops = {
@@ -7,6 +7,9 @@
 #include <linux/mm.h>
 #include <linux/dma-mapping.h>
 #include <linux/uaccess.h>
+#include <linux/ktime.h>
+
+#include "vdrv_irqstat.h"
 
 #define DRIVER_NAME "pcie_dma"
 #define DEVICE_NAME "pcie_dma"
@@ -28,11 +31,16 @@ struct pcie_dma_dev {
     int irq;
     struct cdev cdev;
     dev_t devt;
+    struct vdrv_irqstat irqstat;    // per-CPU completions, folded on read
 };
 
 static struct class *dma_class;
 static struct pcie_dma_dev *dma_dev;
 
+#define VDRV_TRACE_SYSTEM pcie_dma
+#define CREATE_TRACE_POINTS
+#include "vdrv_trace.h"
+
 
 static irqreturn_t dma_irq_handler(int irq, void *dev_id)
 {
@@ -41,7 +49,9 @@ static irqreturn_t dma_irq_handler(int irq, void *dev_id)
     /* Acknowledge device interrupt */
     iowrite32(1, dev->mmio + REG_IRQ_ACK);
 
-    pr_info("[%s] DMA transfer completed\n", DRIVER_NAME);
+    vdrv_irqstat_hit(&dev->irqstat, ktime_get_ns());
+    if (trace_vdrv_irq_enabled()) // folding every CPU is only worth it when someone listens
+        trace_vdrv_irq(DRIVER_NAME, irq, vdrv_irqstat_total(&dev->irqstat));
     return IRQ_HANDLED;
 }
 
@@ -62,6 +72,15 @@ static int dma_mmap(struct file *file, struct vm_area_struct *vma)
                            vma->vm_page_prot);
 }
 
+/* sysfs on the PCI device: completions per CPU and their rates */
+static ssize_t irq_stats_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+    struct pcie_dma_dev *dev = dev_get_drvdata(d);
+
+    return vdrv_irqstat_format(&dev->irqstat, buf);
+}
+static DEVICE_ATTR_RO(irq_stats);
+
 static const struct file_operations dma_fops = {
     .owner = THIS_MODULE,
     .mmap  = dma_mmap,
@@ -76,6 +95,12 @@ static int dma_probe(struct pci_dev *pdev,
     if (!dma_dev)
         return -ENOMEM;
 
+    ret = vdrv_irqstat_init(&dma_dev->irqstat);
+    if (ret) {
+        kfree(dma_dev);
+        return ret;
+    }
+
     dma_dev->pdev = pdev;
     pci_set_drvdata(pdev, dma_dev);
 
@@ -118,6 +143,9 @@ static int dma_probe(struct pci_dev *pdev,
     dma_class = class_create(THIS_MODULE, DEVICE_NAME);
     device_create(dma_class, NULL, dma_dev->devt, NULL, DEVICE_NAME);
 
+    if (device_create_file(&pdev->dev, &dev_attr_irq_stats))
+        pr_warn("[%s] Failed to create irq_stats\n", DRIVER_NAME);
+
     pr_info("[%s] PCIe DMA device initialized\n", DRIVER_NAME);
     return 0;
 
@@ -126,6 +154,7 @@ static int dma_probe(struct pci_dev *pdev,
 
 static void dma_remove(struct pci_dev *pdev)
 {
+    device_remove_file(&pdev->dev, &dev_attr_irq_stats);
     device_destroy(dma_class, dma_dev->devt);
     class_destroy(dma_class);
 
@@ -140,6 +169,7 @@ static void dma_remove(struct pci_dev *pdev)
     pci_release_regions(pdev);
     pci_disable_device(pdev);
 
+    vdrv_irqstat_free(&dma_dev->irqstat);
     kfree(dma_dev);
     pr_info("[%s] Device removed\n", DRIVER_NAME);
 }
@@ -0,0 +1,148 @@
+/*
+ * vdrv_irqstat.h - per-CPU interrupt counters and rate estimators
+ *
+ * Header-only; shared by the drivers in this tree. The handler bumps a
+ * 64-bit counter in its own CPU's slot, so an IRQ that migrates never
+ * bounces a shared cache line and nothing needs an atomic. Each slot also
+ * keeps a rate estimate: the count over ~100 ms windows, smoothed with an
+ * EWMA (new = 3/4 old + 1/4 window). Readers fold all CPUs on demand.
+ *
+ * vdrv_irqstat_hit() must run with interrupts off (any hard IRQ handler).
+ * Updates are wrapped in u64_stats_sync, so readers on 32-bit retry
+ * instead of seeing a torn counter; on 64-bit it compiles away.
+ */
+#ifndef _VDRV_IRQSTAT_H
+#define _VDRV_IRQSTAT_H
+
+#include <linux/types.h>
+#include <linux/percpu.h>
+#include <linux/cpumask.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/u64_stats_sync.h>
+#include <linux/sysfs.h>
+
+#define VDRV_IRQSTAT_WINDOW_NS (100 * NSEC_PER_MSEC)
+
+struct vdrv_irqstat_cpu {
+    u64 count;
+    u64 win_start_ns;       // start of the current rate window
+    u64 win_count;          // count at win_start_ns
+    u64 rate;               // smoothed interrupts per second
+    struct u64_stats_sync syncp;
+};
+
+struct vdrv_irqstat {
+    struct vdrv_irqstat_cpu __percpu *cpu;
+};
+
+static inline int vdrv_irqstat_init(struct vdrv_irqstat *s)
+{
+    int cpu;
+
+    s->cpu = alloc_percpu(struct vdrv_irqstat_cpu);
+    if (!s->cpu)
+        return -ENOMEM;
+    for_each_possible_cpu(cpu)
+        u64_stats_init(&per_cpu_ptr(s->cpu, cpu)->syncp);
+    return 0;
+}
+
+static inline void vdrv_irqstat_free(struct vdrv_irqstat *s)
+{
+    free_percpu(s->cpu);
+    s->cpu = NULL;
+}
+
+// Count one interrupt on this CPU; returns this CPU's new count
+static inline u64 vdrv_irqstat_hit(struct vdrv_irqstat *s, u64 now)
+{
+    struct vdrv_irqstat_cpu *c = this_cpu_ptr(s->cpu);
+    u64 elapsed = now - c->win_start_ns;
+    u64 count = c->count + 1;
+
+    u64_stats_update_begin(&c->syncp);
+    c->count = count;
+    if (elapsed >= VDRV_IRQSTAT_WINDOW_NS) {
+        u64 inst = div64_u64((count - c->win_count) * NSEC_PER_SEC, elapsed);
+
+        c->rate = c->win_start_ns ? (3 * c->rate + inst) / 4 : inst;
+        c->win_start_ns = now;
+        c->win_count = count;
+    }
+    u64_stats_update_end(&c->syncp);
+    return count;
+}
+
+// Consistent copy of one CPU's slot
+static inline void vdrv_irqstat_snapshot(struct vdrv_irqstat *s, int cpu,
+                                         struct vdrv_irqstat_cpu *snap)
+{
+    const struct vdrv_irqstat_cpu *c = per_cpu_ptr(s->cpu, cpu);
+    unsigned int start;
+
+    do {
+        start = u64_stats_fetch_begin(&c->syncp);
+        snap->count = c->count;
+        snap->win_start_ns = c->win_start_ns;
+        snap->win_count = c->win_count;
+        snap->rate = c->rate;
+    } while (u64_stats_fetch_retry(&c->syncp, start));
+}
+
+/*
+ * Rate of one CPU snapshot as of @now. A CPU that stopped taking the
+ * interrupt never closes its window, so once the window is stale report
+ * what the open window implies instead; that decays towards zero. A
+ * window that opened after @now is as fresh as it gets.
+ */
+static inline u64 vdrv_irqstat_cpu_rate(const struct vdrv_irqstat_cpu *c, u64 now)
+{
+    s64 elapsed = now - c->win_start_ns;
+
+    if (!c->win_start_ns || elapsed < 2 * (s64)VDRV_IRQSTAT_WINDOW_NS)
+        return c->rate;
+    return div64_u64((c->count - c->win_count) * NSEC_PER_SEC, elapsed);
+}
+
+static inline u64 vdrv_irqstat_total(struct vdrv_irqstat *s)
+{
+    struct vdrv_irqstat_cpu snap;
+    u64 sum = 0;
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        vdrv_irqstat_snapshot(s, cpu, &snap);
+        sum += snap.count;
+    }
+    return sum;
+}
+
+/*
+ * sysfs rendering: a "total <count> <rate/s>" line, then one
+ * "cpu<N> <count> <rate/s>" line per CPU that has taken the interrupt.
+ */
+static inline int vdrv_irqstat_format(struct vdrv_irqstat *s, char *buf)
+{
+    struct vdrv_irqstat_cpu snap;
+    u64 total = 0, total_rate = 0;
+    int cpu, len;
+
+    // take the time after each snapshot, so no window can start later
+    for_each_possible_cpu(cpu) {
+        vdrv_irqstat_snapshot(s, cpu, &snap);
+        total += snap.count;
+        total_rate += vdrv_irqstat_cpu_rate(&snap, ktime_get_ns());
+    }
+
+    len = sysfs_emit(buf, "total %llu %llu\n", total, total_rate);
+    for_each_possible_cpu(cpu) {
+        vdrv_irqstat_snapshot(s, cpu, &snap);
+        if (snap.count)
+            len += sysfs_emit_at(buf, len, "cpu%d %llu %llu\n", cpu, snap.count,
+                                 vdrv_irqstat_cpu_rate(&snap, ktime_get_ns()));
+    }
+    return len;
+}
+
+#endif /* _VDRV_IRQSTAT_H */
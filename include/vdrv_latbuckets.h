@@ -0,0 +1,22 @@
+/*
+ * vdrv_latbuckets.h - log2 latency bucket layout
+ *
+ * Header-only; shared by the drivers in this tree. Bucket b counts events
+ * that took [2^(b-1), 2^b) ns, the last bucket catches everything slower.
+ */
+#ifndef _VDRV_LATBUCKETS_H
+#define _VDRV_LATBUCKETS_H
+
+#include <linux/types.h>
+#include <linux/log2.h>
+#include <linux/minmax.h>
+
+#define VDRV_LAT_BUCKETS 32
+#define VDRV_LAT_LEGEND "buckets: [2^(b-1), 2^b) ns, b = 0..31"
+
+static inline unsigned int vdrv_lat_bucket(u64 ns)
+{
+    return ns ? min_t(unsigned int, ilog2(ns) + 1, VDRV_LAT_BUCKETS - 1) : 0;
+}
+
+#endif /* _VDRV_LATBUCKETS_H */
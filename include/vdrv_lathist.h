@@ -0,0 +1,165 @@
+/*
+ * vdrv_lathist.h - per-CPU log2 latency histograms
+ *
+ * Header-only; shared by the block drivers in this tree. Requests are
+ * counted in the vdrv_latbuckets.h log2 buckets, split by operation and
+ * request size class. Counters are per-CPU, so the hot path takes no
+ * lock; readers fold all CPUs on demand.
+ */
+#ifndef _VDRV_LATHIST_H
+#define _VDRV_LATHIST_H
+
+#include <linux/types.h>
+#include <linux/percpu.h>
+#include <linux/cpumask.h>
+#include <linux/module.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/sizes.h>
+#include <linux/blk_types.h>
+#include <linux/fs.h>
+#include <linux/seq_file.h>
+#include <linux/sysfs.h>
+
+#include "vdrv_latbuckets.h"
+
+enum { VDRV_LAT_READ, VDRV_LAT_WRITE, VDRV_LAT_DISCARD, VDRV_LAT_OPS };
+enum { VDRV_LAT_SIZES = 5 }; // <=4K, <=16K, <=64K, <=256K, larger
+
+static const char * const vdrv_lat_op_names[VDRV_LAT_OPS] = {
+    "read", "write", "discard",
+};
+
+static const char * const vdrv_lat_size_names[VDRV_LAT_SIZES] = {
+    "4k", "16k", "64k", "256k", "large",
+};
+
+struct vdrv_lathist_cpu {
+    u64 count[VDRV_LAT_OPS][VDRV_LAT_SIZES][VDRV_LAT_BUCKETS];
+};
+
+struct vdrv_lathist {
+    struct vdrv_lathist_cpu __percpu *cpu;
+};
+
+static inline int vdrv_lathist_init(struct vdrv_lathist *h)
+{
+    h->cpu = alloc_percpu(struct vdrv_lathist_cpu);
+    return h->cpu ? 0 : -ENOMEM;
+}
+
+static inline void vdrv_lathist_free(struct vdrv_lathist *h)
+{
+    free_percpu(h->cpu);
+    h->cpu = NULL;
+}
+
+// Count one request of @op and @bytes that started at @start_ns
+static inline void vdrv_lathist_account(struct vdrv_lathist *h, enum req_op op,
+                                        unsigned int bytes, u64 start_ns)
+{
+    u64 ns = ktime_get_ns() - start_ns;
+    unsigned int type, size;
+
+    switch (op) {
+    case REQ_OP_READ:
+        type = VDRV_LAT_READ;
+        break;
+    case REQ_OP_WRITE:
+        type = VDRV_LAT_WRITE;
+        break;
+    case REQ_OP_DISCARD:
+    case REQ_OP_WRITE_ZEROES:
+        type = VDRV_LAT_DISCARD;
+        break;
+    default:
+        return;
+    }
+
+    size = bytes <= SZ_4K ? 0 : min((ilog2(bytes - 1) - 12) / 2 + 1, VDRV_LAT_SIZES - 1);
+
+    this_cpu_inc(h->cpu->count[type][size][vdrv_lat_bucket(ns)]);
+}
+
+static inline u64 vdrv_lathist_sum(struct vdrv_lathist *h, unsigned int type,
+                                   unsigned int size, unsigned int bucket)
+{
+    u64 sum = 0;
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+        sum += per_cpu_ptr(h->cpu, cpu)->count[type][size][bucket];
+    return sum;
+}
+
+static inline void vdrv_lathist_reset(struct vdrv_lathist *h)
+{
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+        memset(per_cpu_ptr(h->cpu, cpu), 0, sizeof(struct vdrv_lathist_cpu));
+}
+
+// sysfs rendering: one row per operation, summed over size classes and CPUs
+static inline int vdrv_lathist_format(struct vdrv_lathist *h, char *buf)
+{
+    unsigned int type, size, bucket;
+    int len = 0;
+
+    for (type = 0; type < VDRV_LAT_OPS; type++) {
+        len += sysfs_emit_at(buf, len, "%s", vdrv_lat_op_names[type]);
+        for (bucket = 0; bucket < VDRV_LAT_BUCKETS; bucket++) {
+            u64 sum = 0;
+
+            for (size = 0; size < VDRV_LAT_SIZES; size++)
+                sum += vdrv_lathist_sum(h, type, size, bucket);
+            len += sysfs_emit_at(buf, len, " %llu", sum);
+        }
+        len += sysfs_emit_at(buf, len, "\n");
+    }
+    return len;
+}
+
+/*
+ * debugfs: full per size class breakdown, any write resets the counters.
+ * Create the file with the struct vdrv_lathist as its data.
+ */
+static int vdrv_lathist_seq_show(struct seq_file *m, void *v)
+{
+    struct vdrv_lathist *h = m->private;
+    unsigned int type, size, bucket;
+
+    seq_puts(m, "# op size  " VDRV_LAT_LEGEND "\n");
+    for (type = 0; type < VDRV_LAT_OPS; type++) {
+        for (size = 0; size < VDRV_LAT_SIZES; size++) {
+            seq_printf(m, "%-7s %-5s", vdrv_lat_op_names[type], vdrv_lat_size_names[size]);
+            for (bucket = 0; bucket < VDRV_LAT_BUCKETS; bucket++)
+                seq_printf(m, " %llu", vdrv_lathist_sum(h, type, size, bucket));
+            seq_putc(m, '\n');
+        }
+    }
+    return 0;
+}
+
+static int vdrv_lathist_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, vdrv_lathist_seq_show, inode->i_private);
+}
+
+static ssize_t vdrv_lathist_write(struct file *file, const char __user *buf,
+                                  size_t count, loff_t *ppos)
+{
+    vdrv_lathist_reset(((struct seq_file *)file->private_data)->private);
+    return count;
+}
+
+static const struct file_operations vdrv_lathist_fops = {
+    .owner   = THIS_MODULE,
+    .open    = vdrv_lathist_open,
+    .read    = seq_read,
+    .write   = vdrv_lathist_write,
+    .llseek  = seq_lseek,
+    .release = single_release,
+};
+
+#endif /* _VDRV_LATHIST_H */
@@ -0,0 +1,201 @@
+/*
+ * vdrv_stats.h - incremental statistics over tumbling time windows
+ *
+ * Header-only; shared by the drivers in this tree. Every sample updates
+ * a Welford mean/variance (16.16 fixed point), min/max and a fixed-size
+ * linear histogram used as a quantile sketch, all in O(1). When a window
+ * ends the running accumulator becomes the published one, so readers
+ * always see a complete window and never walk raw samples.
+ *
+ * Values are integers in the driver's own unit. The sketch covers
+ * [lo, lo + VDRV_STATS_BINS * width); samples outside it land in the
+ * end bins and quantiles are clamped to the observed min/max.
+ *
+ * All calls take st->lock with interrupts off, so samples may be added
+ * from hard IRQ (e.g. hrtimer) context.
+ */
+#ifndef _VDRV_STATS_H
+#define _VDRV_STATS_H
+
+#include <linux/types.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+#include <linux/math64.h>
+#include <linux/ktime.h>
+#include <linux/kernel.h>
+
+#define VDRV_STATS_BINS 64
+#define VDRV_STATS_FRAC 16      // fixed-point fraction bits of mean and m2
+
+struct vdrv_stats_acc {
+    u64 count;
+    s64 mean;                   // 16.16
+    u64 m2;                     // sum of squared deviations, 16.16
+    s64 min, max;
+    u32 bins[VDRV_STATS_BINS];
+};
+
+struct vdrv_stats {
+    spinlock_t lock;
+    u64 window_ns;
+    u64 win_start_ns;
+    s64 lo;                     // sketch geometry
+    u32 width;
+    bool have_last;             // a full window has been published
+    struct vdrv_stats_acc cur;  // window being filled
+    struct vdrv_stats_acc last; // last complete window
+};
+
+// What readers get: plain integers, fractional parts in thousandths
+struct vdrv_stats_summary {
+    u64 count;
+    s64 min, max;
+    s64 mean_milli;
+    u64 stddev_milli;
+    s64 p50, p90, p99;
+    u64 window_ns;
+    u64 window_end_ns;          // CLOCK_MONOTONIC end of the window summarised
+};
+
+static inline void vdrv_stats_acc_reset(struct vdrv_stats_acc *a)
+{
+    memset(a, 0, sizeof(*a));
+    a->min = S64_MAX;
+    a->max = S64_MIN;
+}
+
+static inline void vdrv_stats_init(struct vdrv_stats *st, s64 lo, u32 width, u64 window_ns)
+{
+    spin_lock_init(&st->lock);
+    st->lo = lo;
+    st->width = max(width, 1U);
+    st->window_ns = max_t(u64, window_ns, 1);
+    st->win_start_ns = 0;
+    st->have_last = false;
+    vdrv_stats_acc_reset(&st->cur);
+    vdrv_stats_acc_reset(&st->last);
+}
+
+// Close the running window if @now is past its end. Caller holds st->lock.
+static inline void __vdrv_stats_roll(struct vdrv_stats *st, u64 now)
+{
+    u64 elapsed = now - st->win_start_ns;
+    u64 rem;
+
+    if (!st->win_start_ns) {
+        st->win_start_ns = now;
+        return;
+    }
+    if (elapsed < st->window_ns)
+        return;
+
+    if (elapsed < 2 * st->window_ns) {
+        st->last = st->cur;
+    } else {
+        vdrv_stats_acc_reset(&st->last); // a whole window went by without samples
+    }
+    st->have_last = true;
+    vdrv_stats_acc_reset(&st->cur);
+
+    div64_u64_rem(elapsed, st->window_ns, &rem);
+    st->win_start_ns = now - rem; // stay aligned to the window grid
+}
+
+static inline void vdrv_stats_add(struct vdrv_stats *st, s64 x, u64 now)
+{
+    struct vdrv_stats_acc *a = &st->cur;
+    unsigned long flags;
+    s64 xf = x * (1LL << VDRV_STATS_FRAC);
+    s64 delta, bin;
+
+    spin_lock_irqsave(&st->lock, flags);
+    __vdrv_stats_roll(st, now);
+
+    a->count++;
+    delta = xf - a->mean;
+    a->mean += div64_s64(delta, a->count);
+    a->m2 += (delta * (xf - a->mean)) >> VDRV_STATS_FRAC;
+    a->min = min(a->min, x);
+    a->max = max(a->max, x);
+
+    bin = div64_s64(x - st->lo, st->width);
+    a->bins[clamp_t(s64, bin, 0, VDRV_STATS_BINS - 1)]++;
+
+    spin_unlock_irqrestore(&st->lock, flags);
+}
+
+// Start over with a new window length
+static inline void vdrv_stats_set_window(struct vdrv_stats *st, u64 window_ns)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&st->lock, flags);
+    st->window_ns = max_t(u64, window_ns, 1);
+    st->win_start_ns = 0;
+    st->have_last = false;
+    vdrv_stats_acc_reset(&st->cur);
+    vdrv_stats_acc_reset(&st->last);
+    spin_unlock_irqrestore(&st->lock, flags);
+}
+
+static inline s64 vdrv_stats_quantile(const struct vdrv_stats *st, const struct vdrv_stats_acc *a,
+                                      unsigned int permille)
+{
+    u64 rank = div_u64(a->count * permille + 999, 1000);
+    u64 seen = 0;
+    int i;
+
+    for (i = 0; i < VDRV_STATS_BINS; i++) {
+        seen += a->bins[i];
+        if (seen >= rank)
+            break;
+    }
+    return clamp_t(s64, st->lo + (s64)i * st->width + st->width / 2, a->min, a->max);
+}
+
+/*
+ * Summarise the last complete window, or the running one until the first
+ * window has closed. Cost is bounded by VDRV_STATS_BINS.
+ */
+static inline void vdrv_stats_read(struct vdrv_stats *st, u64 now, struct vdrv_stats_summary *out)
+{
+    const struct vdrv_stats_acc *a;
+    unsigned long flags;
+    u64 var;
+
+    memset(out, 0, sizeof(*out));
+
+    spin_lock_irqsave(&st->lock, flags);
+    __vdrv_stats_roll(st, now);
+    a = st->have_last ? &st->last : &st->cur;
+
+    out->window_ns = st->window_ns;
+    out->window_end_ns = st->have_last ? st->win_start_ns : now;
+    out->count = a->count;
+    if (a->count) {
+        out->min = a->min;
+        out->max = a->max;
+        out->mean_milli = div_s64(a->mean * 1000, 1 << VDRV_STATS_FRAC);
+        if (a->count > 1) {
+            var = div64_u64(a->m2, a->count - 1); // 16.16
+            out->stddev_milli = int_sqrt64(div_u64(var * 1000000, 1 << VDRV_STATS_FRAC));
+        }
+        out->p50 = vdrv_stats_quantile(st, a, 500);
+        out->p90 = vdrv_stats_quantile(st, a, 900);
+        out->p99 = vdrv_stats_quantile(st, a, 990);
+    }
+    spin_unlock_irqrestore(&st->lock, flags);
+}
+
+// One-line sysfs rendering of a summary
+static inline int vdrv_stats_format(const struct vdrv_stats_summary *s, char *buf)
+{
+    return sprintf(buf, "count %llu min %lld max %lld mean %lld.%03llu stddev %llu.%03llu "
+                   "p50 %lld p90 %lld p99 %lld window_ms %llu\n",
+                   s->count, s->min, s->max,
+                   s->mean_milli / 1000, (u64)abs(s->mean_milli % 1000),
+                   s->stddev_milli / 1000, s->stddev_milli % 1000,
+                   s->p50, s->p90, s->p99, div_u64(s->window_ns, NSEC_PER_MSEC));
+}
+
+#endif /* _VDRV_STATS_H */
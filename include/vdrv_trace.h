@@ -0,0 +1,152 @@
+/*
+ * vdrv_trace.h - tracepoints shared by the drivers in this tree
+ *
+ * Replaces per-operation printk on hot paths: a disabled tracepoint costs
+ * a patched-out branch, an enabled one records into the ftrace ring
+ * buffer without touching the console.
+ *
+ * Each module names its own trace system, so events show up as e.g.
+ * vhrm:vdrv_read. In exactly one .c file of the module:
+ *
+ *     #define VDRV_TRACE_SYSTEM vhrm
+ *     #define CREATE_TRACE_POINTS
+ *     #include "vdrv_trace.h"
+ *
+ * and build with ccflags-y += -I$(src)/../include.
+ */
+#ifndef VDRV_TRACE_SYSTEM
+#error "define VDRV_TRACE_SYSTEM before including vdrv_trace.h"
+#endif
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM VDRV_TRACE_SYSTEM
+
+#if !defined(_VDRV_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _VDRV_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/fs.h>
+
+DECLARE_EVENT_CLASS(vdrv_file,
+
+    TP_PROTO(const char *dev, struct file *file),
+
+    TP_ARGS(dev, file),
+
+    TP_STRUCT__entry(
+        __string(dev, dev)
+        __field(unsigned int, f_flags)
+    ),
+
+    TP_fast_assign(
+        __assign_str(dev, dev);
+        __entry->f_flags = file->f_flags;
+    ),
+
+    TP_printk("%s f_flags=0x%x", __get_str(dev), __entry->f_flags)
+);
+
+DEFINE_EVENT(vdrv_file, vdrv_open,
+    TP_PROTO(const char *dev, struct file *file),
+    TP_ARGS(dev, file)
+);
+
+DEFINE_EVENT(vdrv_file, vdrv_release,
+    TP_PROTO(const char *dev, struct file *file),
+    TP_ARGS(dev, file)
+);
+
+TRACE_EVENT(vdrv_read,
+
+    TP_PROTO(const char *dev, size_t len, ssize_t ret),
+
+    TP_ARGS(dev, len, ret),
+
+    TP_STRUCT__entry(
+        __string(dev, dev)
+        __field(size_t, len)
+        __field(ssize_t, ret)
+    ),
+
+    TP_fast_assign(
+        __assign_str(dev, dev);
+        __entry->len = len;
+        __entry->ret = ret;
+    ),
+
+    TP_printk("%s len=%zu ret=%zd", __get_str(dev), __entry->len, __entry->ret)
+);
+
+TRACE_EVENT(vdrv_ioctl,
+
+    TP_PROTO(const char *dev, unsigned int cmd, long ret),
+
+    TP_ARGS(dev, cmd, ret),
+
+    TP_STRUCT__entry(
+        __string(dev, dev)
+        __field(unsigned int, cmd)
+        __field(long, ret)
+    ),
+
+    TP_fast_assign(
+        __assign_str(dev, dev);
+        __entry->cmd = cmd;
+        __entry->ret = ret;
+    ),
+
+    TP_printk("%s cmd=0x%x ret=%ld", __get_str(dev), __entry->cmd, __entry->ret)
+);
+
+TRACE_EVENT(vdrv_mmap,
+
+    TP_PROTO(const char *dev, unsigned long pgoff, unsigned long size, int ret),
+
+    TP_ARGS(dev, pgoff, size, ret),
+
+    TP_STRUCT__entry(
+        __string(dev, dev)
+        __field(unsigned long, pgoff)
+        __field(unsigned long, size)
+        __field(int, ret)
+    ),
+
+    TP_fast_assign(
+        __assign_str(dev, dev);
+        __entry->pgoff = pgoff;
+        __entry->size = size;
+        __entry->ret = ret;
+    ),
+
+    TP_printk("%s pgoff=%lu size=%lu ret=%d", __get_str(dev),
+              __entry->pgoff, __entry->size, __entry->ret)
+);
+
+TRACE_EVENT(vdrv_irq,
+
+    TP_PROTO(const char *dev, int irq, u64 count),
+
+    TP_ARGS(dev, irq, count),
+
+    TP_STRUCT__entry(
+        __string(dev, dev)
+        __field(int, irq)
+        __field(u64, count)
+    ),
+
+    TP_fast_assign(
+        __assign_str(dev, dev);
+        __entry->irq = irq;
+        __entry->count = count;
+    ),
+
+    TP_printk("%s irq=%d count=%llu", __get_str(dev), __entry->irq, __entry->count)
+);
+
+#endif /* _VDRV_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE vdrv_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,73 @@
+/*
+ * vdrv_wake.h - low-water wakeups for single-producer sample rings
+ *
+ * Header-only; shared by the drivers in this tree. Sleeping readers
+ * publish the head value they are waiting for in @at (the lowest one
+ * wins), so the producer only touches the wait queue once the nearest
+ * low-water mark is reached, not on every sample.
+ *
+ * Readers call vdrv_wake_ready() as their wait_event / poll condition,
+ * after the waiter is queued; the producer calls vdrv_wake_publish()
+ * after it has released the new head.
+ */
+#ifndef _VDRV_WAKE_H
+#define _VDRV_WAKE_H
+
+#include <linux/types.h>
+#include <linux/atomic.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+
+struct vdrv_wake {
+    u64 at;                 // head value the earliest waiter needs, U64_MAX if none
+    wait_queue_head_t wq;
+};
+
+#define VDRV_WAKE_INIT(name) {                          \
+    .at = U64_MAX,                                      \
+    .wq = __WAIT_QUEUE_HEAD_INITIALIZER((name).wq),     \
+}
+
+static inline void vdrv_wake_init(struct vdrv_wake *w)
+{
+    w->at = U64_MAX;
+    init_waitqueue_head(&w->wq);
+}
+
+// Producer: @head was just published; wake the readers if one asked for it
+static inline void vdrv_wake_publish(struct vdrv_wake *w, u64 head)
+{
+    u64 at;
+
+    smp_mb(); // new head before checking at, pairs with vdrv_wake_ready()
+    at = READ_ONCE(w->at);
+    if (head >= at) {
+        // a waiter that lowered at meanwhile keeps its target for the next sample
+        cmpxchg64(&w->at, at, U64_MAX);
+        wake_up_interruptible_poll(&w->wq, EPOLLIN | EPOLLRDNORM);
+    }
+}
+
+/*
+ * Reader: true once at least @need samples past @cursor are published in
+ * *@head. Before looking, lower at to this reader's target so the
+ * producer knows when to wake it.
+ */
+static inline bool vdrv_wake_ready(struct vdrv_wake *w, const u64 *head, u64 cursor, u64 need)
+{
+    u64 target = cursor + need;
+    u64 cur = READ_ONCE(w->at);
+
+    while (target < cur) {
+        u64 old = cmpxchg64(&w->at, cur, target);
+
+        if (old == cur)
+            break;
+        cur = old;
+    }
+    smp_mb(); // at before head, pairs with vdrv_wake_publish()
+
+    return READ_ONCE(*head) - cursor >= need;
+}
+
+#endif /* _VDRV_WAKE_H */